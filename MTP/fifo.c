@@ -1,36 +1,212 @@
-﻿#include <err.h>
+﻿#define _GNU_SOURCE
+
+#include <err.h>
 #include <errno.h>
-#include <pthread.h>
+#include <linux/futex.h>
+#include <stdalign.h>
+#include <stdatomic.h>
 #include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
+#include "fifo.h"
+
+#define CACHE_LINE 64
+
 
+/* A ring with exactly one writing thread and one reading thread, which hand
+ * bytes over without taking a lock. The positions are counts of every byte
+ * written and read, which only grow, so the ring fills completely and full
+ * is told from empty by their difference. Each side's position sits on its
+ * own cache line next to its last look at the other side's, so while both
+ * are busy neither keeps pulling in a line the other is writing.
+ *
+ * A side only sleeps when the ring is empty or full, on a futex word the
+ * other side bumps once it has made progress. A sleeper leaves how many bytes
+ * it is waiting for, which lets the busy side skip the system call whenever
+ * nobody is asleep, and is cleared by whoever wakes it so that it is only
+ * woken once. The busy side also holds off until it has made a watermark's
+ * worth of progress, so that a sleeper wakes to a batch of work rather than
+ * to every byte. The batch is cut short by a flush, by closing, or by the
+ * busy side having to sleep itself.
+ */
 struct fifo {
-  unsigned char *start, *end, *read, *write;
-  pthread_mutex_t mutex;
-  pthread_cond_t cond;
-  int read_open : 1, write_open : 1;
+  unsigned char *start;
+  size_t size;
+  int mirrored;  /* The storage is mapped twice in a row, so no span of it ever wraps */
+
+  alignas(CACHE_LINE) atomic_size_t write;  /* Only stored by the writer */
+  size_t read_seen;                         /* The writer's last look at read */
+  size_t data_mark;                         /* Bytes in before the writer wakes the reader */
+
+  alignas(CACHE_LINE) atomic_size_t read;   /* Only stored by the reader */
+  size_t write_seen;                        /* The reader's last look at write */
+  size_t space_mark;                        /* Bytes free before the reader wakes the writer */
+
+  alignas(CACHE_LINE) atomic_uint data_seq, space_seq;
+  atomic_size_t reader_need, writer_need;   /* What a sleeping side waits for, 0 when awake */
+  atomic_int read_open, write_open;
 };
 
 
-struct fifo *
-fifo_create(struct fifo **fifo, size_t size)
+static void
+futex_wait(atomic_uint *word, unsigned int seq)
+{
+  /* Returns at once if word has moved on from seq. Spurious wake ups are fine, every caller checks again */
+  if (syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0) < 0 &&
+          errno != EAGAIN && errno != EINTR) {
+        err(1, "futex_wait"); // Abort, unrecoverable error
+  }
+}
+
+
+static void
+futex_wake(atomic_uint *word)
+{
+  atomic_fetch_add(word, 1);
+  if (syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0) < 0) err(1, "futex_wake");
+}
+
+
+/* Wake the reader if it is asleep and the bytes in come to both what it waits for and mark */
+static void
+wake_reader(struct fifo *fifo, size_t mark)
+{
+  size_t need = atomic_load(&fifo->reader_need);
+  if (need == 0) return;
+  size_t in = atomic_load(&fifo->write) - atomic_load(&fifo->read);
+  if (in < need || in < mark) return;
+  if (atomic_compare_exchange_strong(&fifo->reader_need, &need, 0)) futex_wake(&fifo->data_seq);
+}
+
+
+/* Wake the writer if it is asleep and the bytes free come to both what it waits for and mark */
+static void
+wake_writer(struct fifo *fifo, size_t mark)
+{
+  size_t need = atomic_load(&fifo->writer_need);
+  if (need == 0) return;
+  size_t space = fifo->size - (atomic_load(&fifo->write) - atomic_load(&fifo->read));
+  if (space < need || space < mark) return;
+  if (atomic_compare_exchange_strong(&fifo->writer_need, &need, 0)) futex_wake(&fifo->space_seq);
+}
+
+
+/* Block until the writer has published at least need bytes past read or closed,
+ * returning the bytes there are to read, fewer than need only once it has closed */
+static size_t
+wait_data(struct fifo *fifo, size_t read, size_t need)
+{
+  for (;;) {
+        /* Open is checked before write, so nothing written before closing is missed */
+        int open = atomic_load(&fifo->write_open);
+        fifo->write_seen = atomic_load_explicit(&fifo->write, memory_order_acquire);
+        if (fifo->write_seen - read >= need || !open) return fifo->write_seen - read;
+
+        /* A writer held off by the watermark must not be left asleep while this side sleeps too */
+        wake_writer(fifo, 0);
+
+        /* Announce the wait before looking again, so a writer publishing in between
+         * either is seen here or sees the need and bumps the word under us */
+        unsigned int seq = atomic_load(&fifo->data_seq);
+        atomic_store(&fifo->reader_need, need);
+        if (atomic_load(&fifo->write) == fifo->write_seen && atomic_load(&fifo->write_open)) {
+          futex_wait(&fifo->data_seq, seq);
+        }
+        atomic_store(&fifo->reader_need, 0);
+  }
+}
+
+
+/* Block until the reader has freed room for at least need bytes behind write or
+ * closed, returning the bytes there is room for, 0 only if it closed first */
+static size_t
+wait_space(struct fifo *fifo, size_t write, size_t need)
+{
+  for (;;) {
+        fifo->read_seen = atomic_load_explicit(&fifo->read, memory_order_acquire);
+        size_t room = fifo->size - (write - fifo->read_seen);
+        if (room >= need) return room;
+        if (!atomic_load(&fifo->read_open)) return 0;
+
+        wake_reader(fifo, 0);
+
+        unsigned int seq = atomic_load(&fifo->space_seq);
+        atomic_store(&fifo->writer_need, need);
+        if (atomic_load(&fifo->read) == fifo->read_seen && atomic_load(&fifo->read_open)) {
+          futex_wait(&fifo->space_seq, seq);
+        }
+        atomic_store(&fifo->writer_need, 0);
+  }
+}
+
+
+/* Point span at the len bytes of the ring from position pos, the second piece
+ * only holding what runs past the end of the storage */
+static void
+fill_spans(struct fifo *fifo, size_t pos, size_t len, struct iovec span[2])
+{
+  size_t at = pos % fifo->size, first = fifo->mirrored ? len : fifo->size - at;
+  if (first > len) first = len;
+  span[0].iov_base = fifo->start + at;
+  span[0].iov_len = first;
+  span[1].iov_base = fifo->start;
+  span[1].iov_len = len - first;
+}
+
+
+/* Map size bytes of shared memory twice back to back, so that the bytes past the end of
+ * the first copy are the ones at its start. NULL if size is not a whole number of pages
+ * or the system will not have it */
+static unsigned char *
+map_mirrored(size_t size)
+{
+  long page = sysconf(_SC_PAGESIZE);
+  if (page <= 0 || size == 0 || size % page != 0) return NULL;
+  int fd = memfd_create("fifo", MFD_CLOEXEC);
+  if (fd < 0) return NULL;
+  unsigned char *start = MAP_FAILED;
+  if (ftruncate(fd, size) < 0) goto end;
+  /* Claim room for both copies first, so nothing else can be mapped between them */
+  start = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (start == MAP_FAILED) goto end;
+  if (mmap(start, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+          mmap(start + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(start, 2 * size);
+        start = MAP_FAILED;
+  }
+end:
+  close(fd);
+  return start == MAP_FAILED ? NULL : start;
+}
+
+
+static struct fifo *
+create(struct fifo **fifo, size_t size, int mirrored)
 {
   int save_errno = errno;
-  struct fifo *_fifo = malloc(sizeof *_fifo);
+  struct fifo *_fifo = aligned_alloc(CACHE_LINE, sizeof *_fifo);
   if (!_fifo) goto end;
-  _fifo->start = malloc(sizeof *_fifo->start * size);
+  _fifo->start = mirrored ? map_mirrored(size) : NULL;
+  _fifo->mirrored = _fifo->start != NULL;
+  if (!_fifo->mirrored) _fifo->start = malloc(sizeof *_fifo->start * size); /* Or just the one copy */
   if (!_fifo->start) goto err_1;
-  if ((errno = pthread_mutex_init(&_fifo->mutex, NULL)) ||
-          (errno = pthread_cond_init(&_fifo->cond, NULL))) {
-        err(1, "fifo_create"); // Abort, unrecoverable error
-  }
-  _fifo->end = _fifo->start + size;
-  _fifo->read = _fifo->start;
-  _fifo->write = _fifo->start;
-  _fifo->read_open = 1;
-  _fifo->write_open = 1;
+  _fifo->size = size;
+  atomic_init(&_fifo->write, 0);
+  atomic_init(&_fifo->read, 0);
+  _fifo->read_seen = 0;
+  _fifo->write_seen = 0;
+  atomic_init(&_fifo->data_seq, 0);
+  atomic_init(&_fifo->space_seq, 0);
+  _fifo->data_mark = 1;
+  _fifo->space_mark = 1;
+  atomic_init(&_fifo->reader_need, 0);
+  atomic_init(&_fifo->writer_need, 0);
+  atomic_init(&_fifo->read_open, 1);
+  atomic_init(&_fifo->write_open, 1);
   goto end;
 err_1:
   free(_fifo);
@@ -42,16 +218,114 @@ end:
 }
 
 
+struct fifo *
+fifo_create(struct fifo **fifo, size_t size)
+{
+  return create(fifo, size, 0);
+}
+
+
+struct fifo *
+fifo_create_mirrored(struct fifo **fifo, size_t size)
+{
+  return create(fifo, size, 1);
+}
+
+
+void
+fifo_set_watermarks(struct fifo *fifo, size_t data, size_t space)
+{
+  /* Past the size they could never be reached and the sleeper would only wake to a flush */
+  fifo->data_mark = data < 1 ? 1 : data > fifo->size ? fifo->size : data;
+  fifo->space_mark = space < 1 ? 1 : space > fifo->size ? fifo->size : space;
+}
+
+
 void
 fifo_destroy(struct fifo *fifo)
 {
-  int save_errno = errno;
   if (!fifo) return;
-  free(fifo->start);
-  if ((errno = pthread_mutex_destroy(&fifo->mutex))) err(1, "pthread_mutex_destroy");
-  if ((errno = pthread_cond_destroy(&fifo->cond))) err(1, "pthread_cond_destroy");
+  if (fifo->mirrored) munmap(fifo->start, 2 * fifo->size);
+  else free(fifo->start);
   free(fifo);
+}
+
+
+ssize_t
+fifo_write_reserve(struct fifo *fifo, struct iovec span[2], size_t min)
+{
+  int save_errno = errno;
+  ssize_t room = -1;
+  if (!fifo || !span || min > fifo->size) {
+        save_errno = EINVAL;
+        goto end;
+  }
+  size_t write = atomic_load_explicit(&fifo->write, memory_order_relaxed);
+  size_t space = fifo->size - (write - fifo->read_seen);
+  if (space < min && (space = wait_space(fifo, write, min)) < min) {
+        save_errno = EPIPE;
+        goto end;
+  }
+  fill_spans(fifo, write, space, span);
+  room = space;
+end:
   errno = save_errno;
+  return room;
+}
+
+
+void
+fifo_write_commit(struct fifo *fifo, size_t n)
+{
+  size_t write = atomic_load_explicit(&fifo->write, memory_order_relaxed) + n;
+  /* Publishing and then checking for a sleeping reader must not be reordered, hence sequentially consistent */
+  atomic_store(&fifo->write, write);
+  wake_reader(fifo, fifo->data_mark);
+}
+
+
+void
+fifo_flush(struct fifo *fifo)
+{
+  wake_reader(fifo, 0);
+}
+
+
+ssize_t
+fifo_read_peek(struct fifo *fifo, struct iovec span[2], size_t min)
+{
+  int save_errno = errno;
+  ssize_t avail = -1;
+  if (!fifo || !span || min > fifo->size) {
+        save_errno = EINVAL;
+        goto end;
+  }
+  size_t read = atomic_load_explicit(&fifo->read, memory_order_relaxed);
+  size_t in = fifo->write_seen - read;
+  if (in < min) in = wait_data(fifo, read, min);
+  fill_spans(fifo, read, in, span);
+  avail = in;
+end:
+  errno = save_errno;
+  return avail;
+}
+
+
+size_t
+fifo_read_avail(struct fifo *fifo)
+{
+  size_t read = atomic_load_explicit(&fifo->read, memory_order_relaxed);
+  fifo->write_seen = atomic_load_explicit(&fifo->write, memory_order_acquire);
+  return fifo->write_seen - read;
+}
+
+
+void
+fifo_read_release(struct fifo *fifo, size_t n)
+{
+  size_t read = atomic_load_explicit(&fifo->read, memory_order_relaxed) + n;
+  atomic_store(&fifo->read, read);
+  wake_writer(fifo, fifo->space_mark);
 }
 
 
@@ -62,121 +336,92 @@ fifo_write(struct fifo *fifo, void const *buf, size_t n)
   ssize_t i = 0;
   if (!fifo || !buf) {
         i = -1;
-        errno = EINVAL;
+        save_errno = EINVAL;
         goto end;
   }
-  if (n == 0) goto end;
-  unsigned char *write, *read;
-  write = fifo->write;
-  read = write + 1;
 
 
-  for (;;) {
-        /* Loop freely until reaching read position (don't write into read-only region) */
-        while (i < n && write + 1 != read && (read != fifo->start || write + 1 != fifo->end)) {
-          *(write++) = ((unsigned char const *)buf)[i++];
-          if (write == fifo->end) write = fifo->start;
+  while ((size_t)i < n) {
+        struct iovec span[2];
+        ssize_t room = fifo_write_reserve(fifo, span, 1);
+        if (room < 0) {
+          save_errno = errno;
+          i = -1;
+          goto end;
         }
-        if ((errno = pthread_mutex_lock(&fifo->mutex))) err(1, "pthread_mutex_lock");
-        /* Update the shared write position and signal condition waiters */
-        fifo->write = write;
-        if ((errno = pthread_cond_signal(&fifo->cond))) err(1, "pthread_cond_signal");
+        if ((size_t)room > n - i) room = n - i;
 
-
-        /* if all bytes have been written, we are done */
-        if (i == n) {
-          if ((errno = pthread_mutex_unlock(&fifo->mutex))) err(1, "pthread_mutex_unlock");
-          break;
-        }
-        /* Otherwise, continuously (re-)check the read-only position until there is more room to write */
-        for (;;) {
-          read = fifo->read;
-          if (write + 1 != read && (read != fifo->start || write + 1 != fifo->end)) break;
-          if (!fifo->read_open) {
-            save_errno = EPIPE;
-            i = -1;
-            if ((errno = pthread_mutex_unlock(&fifo->mutex))) err(1, "pthread_mutex_unlock");
-            goto end;
-          }
-          if ((errno = pthread_cond_wait(&fifo->cond, &fifo->mutex))) err(1, "pthread_cond_wait");
-        }
-        if ((errno = pthread_mutex_unlock(&fifo->mutex))) err(1, "pthread_mutex_unlock");
+        /* Copy in up to the end of the storage and the rest from its start */
+        size_t first = span[0].iov_len < (size_t)room ? span[0].iov_len : (size_t)room;
+        memcpy(span[0].iov_base, (unsigned char const *)buf + i, first);
+        memcpy(span[1].iov_base, (unsigned char const *)buf + i + first, room - first);
+        fifo_write_commit(fifo, room);
+        i += room;
   }
+  fifo_flush(fifo);
 end:
   errno = save_errno;
   return i;
 }
 
 
-ssize_t
-fifo_read(struct fifo *fifo, void *buf, size_t n)
+/* Read up to n bytes, blocking until all n are in or the writer closes if all is
+ * set and only until at least one is otherwise */
+static ssize_t
+read_bytes(struct fifo *fifo, void *buf, size_t n, int all)
 {
   int save_errno = errno;
   ssize_t i = 0;
   if (!fifo || !buf) {
         i = -1;
-        errno = EINVAL;
+        save_errno = EINVAL;
         goto end;
   }
-  if (n == 0) goto end;
-  unsigned char *write, *read;
-  read = fifo->read;
-  write = read;
-
-
-  int eof = 0;
-  while (!eof) {
-        /* Loop freely until reaching write position (don't read from write-only region) */
-        while (i < n && read != write) {
-          ((unsigned char *)buf)[i++] = *(read++);
-          if (read == fifo->end) read = fifo->start;
-        }
-        if ((errno = pthread_mutex_lock(&fifo->mutex))) err(1, "pthread_mutex_lock");
-        /* Update the shared read position and signal condition waiters */
-        fifo->read = read;
-        if ((errno = pthread_cond_signal(&fifo->cond))) err(1, "pthread_cond_signal");
-        /* if all bytes have been read, we are done */
-        if (i == n) {
-          if ((errno = pthread_mutex_unlock(&fifo->mutex))) err(1, "pthread_mutex_unlock");
-          break;
-        }
-        for (;;) {
-          write = fifo->write;
-          if (read != write) break; /* More data to read */
-          if (!fifo->write_open) {
-            eof = 1;
-            break;
-          }
-          if ((errno = pthread_cond_wait(&fifo->cond, &fifo->mutex))) err(1, "pthread_cond_wait");
-        }
-        if ((errno = pthread_mutex_unlock(&fifo->mutex))) err(1, "pthread_mutex_unlock");
+
+
+  while ((size_t)i < n && (all || i == 0)) {
+        struct iovec span[2];
+        ssize_t avail = fifo_read_peek(fifo, span, 1);
+        if (avail == 0) break; /* End of file */
+        if ((size_t)avail > n - i) avail = n - i;
+
+        size_t first = span[0].iov_len < (size_t)avail ? span[0].iov_len : (size_t)avail;
+        memcpy((unsigned char *)buf + i, span[0].iov_base, first);
+        memcpy((unsigned char *)buf + i + first, span[1].iov_base, avail - first);
+        fifo_read_release(fifo, avail);
+        i += avail;
   }
 end:
   errno = save_errno;
   return i;
 }
 
+
+ssize_t
+fifo_read(struct fifo *fifo, void *buf, size_t n)
+{
+  return read_bytes(fifo, buf, n, 1);
+}
+
+
+ssize_t
+fifo_read_some(struct fifo *fifo, void *buf, size_t n)
+{
+  return read_bytes(fifo, buf, n, 0);
+}
+
 void
 fifo_close_read(struct fifo *fifo)
 {
-  int save_errno = errno;
   if (!fifo) return;
-  if ((errno = pthread_mutex_lock(&fifo->mutex))) err(1, "pthread_mutex_lock");
-  fifo->read_open = 0;
-  if ((errno = pthread_cond_signal(&fifo->cond))) err(1, "pthread_cond_signal");
-  if ((errno = pthread_mutex_unlock(&fifo->mutex))) err(1, "pthread_mutex_unlock");
-  errno = save_errno;
+  atomic_store(&fifo->read_open, 0);
+  futex_wake(&fifo->space_seq);
 }
 
 void
 fifo_close_write(struct fifo *fifo)
 {
-  int save_errno = errno;
   if (!fifo) return;
-  if ((errno = pthread_mutex_lock(&fifo->mutex))) err(1, "pthread_mutex_lock");
-  fifo->write_open = 0;
-  if ((errno = pthread_cond_signal(&fifo->cond))) err(1, "pthread_cond_signal");
-  if ((errno = pthread_mutex_unlock(&fifo->mutex))) err(1, "pthread_mutex_unlock");
-  errno = save_errno;
+  atomic_store(&fifo->write_open, 0);
+  futex_wake(&fifo->data_seq);
 }
-
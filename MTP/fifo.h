@@ -3,17 +3,60 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 struct fifo;
 
 struct fifo *fifo_create(struct fifo **fifo, size_t size);
 
+/* Like fifo_create, but maps the storage twice back to back so that the bytes handed out by
+ * fifo_write_reserve and fifo_read_peek always come as one span and copies in and out are a
+ * single memcpy. Falls back to an ordinary ring if size is not a whole number of pages or
+ * the mapping cannot be made */
+struct fifo *fifo_create_mirrored(struct fifo **fifo, size_t size);
+
+/* Let a sleeping reader be woken only once data bytes are in, and a sleeping writer only
+ * once space bytes are free, rather than after every write and read. A reader is still
+ * woken early by fifo_flush or fifo_close_write, and either side as soon as the other has
+ * to sleep itself. Both start at 1 and are best set before either side starts */
+void fifo_set_watermarks(struct fifo *fifo, size_t data, size_t space);
+
 void fifo_destroy(struct fifo *fifo);
 
 ssize_t fifo_write(struct fifo *fifo, void const *buf, size_t n);
 
 ssize_t fifo_read(struct fifo *fifo, void *buf, size_t n);
 
+/* Like fifo_read, but returns as soon as at least one byte is in rather than waiting for all n */
+ssize_t fifo_read_some(struct fifo *fifo, void *buf, size_t n);
+
+/* The calls below hand out the ring itself instead of copying through a buffer. The bytes
+ * they point at are described by two spans, the second one empty unless they run past the
+ * end of the storage and carry on from its start.
+ *
+ * Block until there is room for at least min bytes and point span at all the room there
+ * is, returning its size. The bytes only reach the reader once committed, and committing
+ * fewer than reserved leaves the rest to be reserved again. Returns -1 with errno EPIPE
+ * if the reader has closed */
+ssize_t fifo_write_reserve(struct fifo *fifo, struct iovec span[2], size_t min);
+
+/* Hand the first n bytes of the last reservation to the reader */
+void fifo_write_commit(struct fifo *fifo, size_t n);
+
+/* Wake the reader for whatever has been committed so far, watermark or not. fifo_write
+ * does this before returning */
+void fifo_flush(struct fifo *fifo);
+
+/* Block until at least min bytes are in and point span at all of them, returning how
+ * many. Returns fewer than min only once the writer has closed, 0 when nothing is left */
+ssize_t fifo_read_peek(struct fifo *fifo, struct iovec span[2], size_t min);
+
+/* How many bytes are in right now, without waiting for any */
+size_t fifo_read_avail(struct fifo *fifo);
+
+/* Give the first n bytes of the last peek back to the writer */
+void fifo_read_release(struct fifo *fifo, size_t n);
+
 void fifo_close_read(struct fifo *fifo);
 
 void fifo_close_write(struct fifo *fifo);
@@ -5,146 +5,262 @@
 #include <string.h>
 #include <ctype.h>
 #include <err.h>
-#include <pthread.h>
+#include <errno.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include "fifo.h"
+#include "pipeline.h"
 
 #define arrlen(arr) (sizeof(arr) / sizeof *(arr))
 
-
-struct thread_args 
-{
-  struct fifo *in, *out;
-};
+#define LINE_LENGTH 80
+#define NO_MATCH ((size_t)-1)
 
 
-void *input_thread(void *_targs)
+/* First stage, reading stdin into out up to a line of just STOP */
+static void
+read_input(struct fifo *in, struct fifo *out, void *state)
 {
-  struct thread_args *targs = _targs;
-  for (;;) {
-        char *inStr = NULL;
-        size_t length = 0;
-        int numRead = getline(&inStr, &length, stdin); // Get the next line of text from stdin and use its return value in the next fifo_write
-        if (numRead == -1) break;
-        if (strcmp(inStr, "STOP\n") == 0) 
+  static char const stopLine[] = "STOP\n";
+  size_t matched = 0; // How much of the current line has matched STOP so far, NO_MATCH once it cannot
+  int stopped = 0;
+  while (!stopped) {
+        // Read straight into the ring, past the start of what could be a STOP line held back
+        // there uncommitted from the last read. read rather than getline, so that a whole chunk
+        // of lines goes to the next stage at once while a line typed at a terminal still goes
+        // on as soon as it is entered
+        struct iovec span[2];
+        size_t held = matched == NO_MATCH ? 0 : matched;
+        if (fifo_write_reserve(out, span, held + 1) == -1) err(1, "fifo_write_reserve");
+        struct iovec *room = span;
+        int pieces = 2;
+        size_t skip = held;
+        if (skip >= span[0].iov_len)
+        {
+          skip -= span[0].iov_len;
+          ++room;
+          --pieces;
+        }
+        room->iov_base = (char *)room->iov_base + skip;
+        room->iov_len -= skip;
+        ssize_t r = readv(STDIN_FILENO, room, pieces);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) err(1, "readv");
+        if (r == 0) break;
+
+        // Look for STOP through the bytes just read, piece by piece
+        size_t pos = held, keep = 0, left = r;
+        for (int k = 0; k < pieces && left > 0 && !stopped; ++k)
         {
-          break;
+          char *p = room[k].iov_base, *end = p + (room[k].iov_len < left ? room[k].iov_len : left);
+          left -= end - p;
+          while (p < end) {
+            if (matched != NO_MATCH) // Still at what could be a STOP line
+            {
+              char *from = p;
+              while (p < end && matched < sizeof stopLine - 1 && *p == stopLine[matched]) 
+              {
+                ++matched;
+                ++p;
+              }
+              pos += p - from;
+              if (matched == sizeof stopLine - 1) 
+              {
+                stopped = 1;
+                keep = pos - matched; // Everything before the STOP line
+                break;
+              }
+              if (p == end) break;
+              matched = NO_MATCH;
+            }
+            char *nl = memchr(p, '\n', end - p);
+            char *next = nl ? nl + 1 : end;
+            pos += next - p;
+            p = next;
+            if (nl) matched = 0;
+          }
         }
-        if (fifo_write(targs->out, inStr, numRead) == -1) err(1, "fifo_read");
-        free(inStr);
+        if (!stopped) keep = matched == NO_MATCH ? pos : pos - matched; // Hold back what could still be STOP
+        fifo_write_commit(out, keep);
+        fifo_flush(out); // Each read is as much as there is for now, so do not hold it for the watermark
   }
-  fifo_close_read(targs->in);
-  fifo_close_write(targs->out);
-  return targs;
+  if (!stopped && matched != NO_MATCH) fifo_write_commit(out, matched); // Input ended partway into something like STOP
 }
 
 
-void *line_separator_thread(void *_targs)
+/* Turns every line separator into a space */
+static size_t
+separate_lines(char const *in, size_t inLen, char *out, size_t outLen, size_t *used, void *state)
 {
-  struct thread_args *targs = _targs;
-  for (;;) {
-        char c;
-        ssize_t r = fifo_read(targs->in, &c, 1);
-        if (r < 0) err(1, "fifo_read");
-        if (r == 0) break;
-        if (c == '\n') c = ' ';
-        if (fifo_write(targs->out, &c, r) == -1) err(1, "fifo_write");
-  }
-  fifo_close_read(targs->in);
-  fifo_close_write(targs->out);
-  return targs;
+  size_t n = inLen < outLen ? inLen : outLen;
+  memcpy(out, in, n);
+  // Jump from newline to newline rather than looking at every character in turn
+  for (char *nl = out; (nl = memchr(nl, '\n', out + n - nl)) != NULL; ) *nl++ = ' ';
+  *used = n;
+  return n;
 }
 
 
-void *replace_thread(void *_targs)
+/* Turns every ++ into a ^ */
+static size_t
+replace_pluses(char const *in, size_t inLen, char *out, size_t outLen, size_t *used, void *state)
 {
-  struct thread_args *targs = _targs;
-  for (;;) 
+  int *heldPlus = state; // The last piece ended in a + that may pair with the first character of this one
+  char const *p = in, *end = in + inLen;
+  char *o = out, *oend = out + outLen;
+  if (*heldPlus)
   {
-        char c;
-        ssize_t r = fifo_read(targs->in, &c,  1);
-        if (r < 0) err(1, "fifo_read");
-        if (r == 0) break;
-        if (c == '+') // If we find an instance of a +, grab the next character for comparison
-        {
-          char compChar;
-          ssize_t compR = fifo_read(targs->in, &compChar, 1);
-          if(compR < 0) err(1, "comp fifo_read");
-          if(compR == 0) // Nothing read, write the previously grabbed character to the next buffer
-          {
-            if(fifo_write(targs->out, &c, r) == -1) err(1, "comp fifo_write");
-            break;
-          }
-          if(compChar == '+') // + found, replace the compChar with a carat and write it to the next buffer
-          {
-            compChar = '^';
-            if(fifo_write(targs->out, &compChar, compR) == -1) err(1, "carrat fifo_write");
-          }
-          else // No additional + found, write both to the next buffer
-          {
-            if (fifo_write(targs->out, &c, r) == -1) err(1, "fifo_write");
-            if (fifo_write(targs->out, &compChar, compR) == -1) err(1, "fifo_write");
-          }
-        }
-        else // Regular character, write to the next buffer
-        {
-          if (fifo_write(targs->out, &c, r) == -1) err(1, "fifo_write");
-        }
+    *heldPlus = 0;
+    if (p < end && *p == '+') 
+    {
+      *o++ = '^';
+      ++p;
+    }
+    else // Including at the end of the input, where it stays a lone +
+    {
+      *o++ = '+';
+    }
   }
-  fifo_close_read(targs->in);
-  fifo_close_write(targs->out);
-  return targs;
+  while (p < end && o < oend)
+  {
+    // Copy everything up to the next + at once, then look at what follows it
+    size_t n = end - p < oend - o ? end - p : oend - o;
+    char const *plus = memchr(p, '+', n);
+    if (plus == NULL) plus = p + n;
+    memcpy(o, p, plus - p);
+    o += plus - p;
+    p = plus;
+    if (p == end || o == oend) break;
+    if (p + 1 == end) // Nothing after it yet, decide once the next piece is in
+    {
+      *heldPlus = 1;
+      ++p;
+      break;
+    }
+    if (p[1] == '+') // + found, replace the pair with a carat
+    {
+      *o++ = '^';
+      p += 2;
+    }
+    else // No additional + found, the + stays as it is
+    {
+      *o++ = '+';
+      ++p;
+    }
+  }
+  *used = p - in;
+  return o - out;
 }
 
 
-void *output_thread(void *_targs)
+/* Last stage, printing in to stdout in lines of LINE_LENGTH */
+static void
+write_output(struct fifo *in, struct fifo *out, void *state)
 {
-  struct thread_args *targs = _targs;
   for (;;) 
   {
-    char *toPrint = malloc(81); 
-    ssize_t r = fifo_read(targs->in, toPrint, 80); 
-    if (r < 0) err(1, "fifo_read");
-    if (r == 0) break;
-    if(r == 80) //If we read 80 characters, null terminate the string, print it, then free it
+    // Print every complete line straight out of the ring, a line that runs past its end in two pieces
+    struct iovec span[2];
+    ssize_t avail = fifo_read_peek(in, span, LINE_LENGTH);
+    if (avail < 0) err(1, "fifo_read_peek");
+    if (avail < LINE_LENGTH) break;
+    size_t lines = avail / LINE_LENGTH;
+    for (size_t k = 0, at = 0; k < lines; ++k, at += LINE_LENGTH)
     {
-      toPrint[strlen(toPrint)] = '\0';
-      printf("%s\n", toPrint);
-      free(toPrint);
-      fflush(stdout);
+      if (at + LINE_LENGTH <= span[0].iov_len)
+      {
+        fwrite((char *)span[0].iov_base + at, 1, LINE_LENGTH, stdout);
+      }
+      else
+      {
+        size_t first = at < span[0].iov_len ? span[0].iov_len - at : 0;
+        fwrite((char *)span[0].iov_base + at, 1, first, stdout);
+        fwrite((char *)span[1].iov_base + (at + first - span[0].iov_len), 1, LINE_LENGTH - first, stdout);
+      }
+      putchar('\n');
     }
+    fifo_read_release(in, lines * LINE_LENGTH);
+    fflush(stdout); // Once for all the lines there were rather than once per line
   }
-  fifo_close_read(targs->in);
-  fifo_close_write(targs->out);
-  return targs; 
 }
 
 
 
 
-int
-main(int argc, char *argv[])
+/* Fill sizes from a comma separated list of either one value for all count of them or one
+ * value each. Returns -1 if arg is not such a list, 0 on success */
+static int
+parse_sizes(char const *arg, size_t sizes[], size_t count)
 {
-  struct fifo *fifos[3];
-  for (size_t i = 0; i < arrlen(fifos); ++i) {
-        fifo_create(&fifos[i], 1024);
+  size_t n = 0;
+  char *end;
+  do
+  {
+    if (n == count || !isdigit((unsigned char)*arg)) return -1;
+    errno = 0;
+    unsigned long long value = strtoull(arg, &end, 10);
+    if (errno || (*end && *end != ',')) return -1;
+    sizes[n++] = value;
+    arg = end + 1;
+  } while (*end == ',');
+  if (n == 1)
+  {
+    for (size_t i = 1; i < count; ++i) sizes[i] = sizes[0];
   }
+  else if (n != count)
+  {
+    return -1;
+  }
+  return 0;
+}
 
 
-  pthread_t threads[4];
-  pthread_create(&threads[0], NULL, input_thread, &(struct thread_args) {.in=NULL, .out=fifos[0]});
-  pthread_create(&threads[1], NULL, line_separator_thread, &(struct thread_args) {.in=fifos[0], .out=fifos[1]});
-  pthread_create(&threads[2], NULL, replace_thread, &(struct thread_args) {.in=fifos[1], .out=fifos[2]});
-  pthread_create(&threads[3], NULL, output_thread, &(struct thread_args) {.in=fifos[2], .out=NULL});
- 
-  for (size_t i = 0; i < arrlen(threads); ++i) {
-        pthread_join(threads[i], NULL);
+int
+main(int argc, char *argv[])
+{
+  static char const usage[] = "usage: %s [-F] [-s size[,size,size]] [-w bytes[,bytes,bytes]]";
+  int heldPlus = 0;
+  struct pipeline_stage stages[] = {
+    {.name = "input", .run = read_input},
+    {.name = "line separator", .transform = separate_lines},
+    {.name = "replace", .transform = replace_pluses, .state = &heldPlus},
+    {.name = "output", .run = write_output},
+  };
+  size_t sizes[arrlen(stages) - 1], marks[arrlen(stages) - 1] = {0}; // For the fifo after each stage but the last
+  for (size_t i = 0; i < arrlen(sizes); ++i) sizes[i] = PIPELINE_FIFO_SIZE;
+
+  // The environment first, so that options given on the command line win
+  char const *env = getenv("LINE_PROCESSOR_FIFO_SIZES");
+  if (env && parse_sizes(env, sizes, arrlen(sizes)) < 0) errx(1, "bad LINE_PROCESSOR_FIFO_SIZES: %s", env);
+  env = getenv("LINE_PROCESSOR_WATERMARKS");
+  if (env && parse_sizes(env, marks, arrlen(marks)) < 0) errx(1, "bad LINE_PROCESSOR_WATERMARKS: %s", env);
+  int opt;
+  while ((opt = getopt(argc, argv, "Fs:w:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'F': // Both transforms do so little per byte that handing bytes between them can cost more
+        stages[2].fuse = 1;
+        break;
+      case 's':
+        if (parse_sizes(optarg, sizes, arrlen(sizes)) < 0) errx(1, usage, argv[0]);
+        break;
+      case 'w':
+        if (parse_sizes(optarg, marks, arrlen(marks)) < 0) errx(1, usage, argv[0]);
+        break;
+      default:
+        errx(1, usage, argv[0]);
+    }
   }
-  for (size_t i = 0; i < arrlen(fifos); ++i) {
-        fifo_destroy(fifos[i]);
-        fifos[i] = NULL;
+  if (optind != argc) errx(1, usage, argv[0]);
+
+  for (size_t i = 0; i < arrlen(sizes); ++i) {
+        if (sizes[i] < LINE_LENGTH) errx(1, "fifo size %zu is too small, it must hold a line of %d", sizes[i], LINE_LENGTH);
+        stages[i].size = sizes[i];
+        stages[i].mark = marks[i]; // 0 leaves it to the size of the fifo
   }
+  pipeline_run(stages, arrlen(stages));
 }
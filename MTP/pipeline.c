@@ -0,0 +1,192 @@
+﻿#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "fifo.h"
+#include "pipeline.h"
+
+#define WAKE_DIVISOR 4      /* Unless given, a stage is woken once a quarter of its fifo is ready for it */
+#define FUSED_BUFFER 16384  /* Bytes held between two transforms fused into one thread */
+
+
+/* The bytes one fused transform has written and the next has not read yet */
+struct fused_buffer {
+  char *data;
+  size_t start, len;
+};
+
+
+/* Transforms fused into one, with a buffer between each one and the next */
+struct fused {
+  struct pipeline_stage const *stages;
+  size_t count;
+  struct fused_buffer *buffers;  /* count - 1 of them */
+  int *ended;                    /* Which transforms have written out all they ever will */
+};
+
+
+/* The stages run by one thread, either a single one or transforms fused together */
+struct group {
+  struct pipeline_stage const *stages;
+  size_t count;
+  struct fifo *in, *out;
+};
+
+
+/* Moves bytes along every transform of a fused group until none of them can go any further,
+ * so that to the thread running it the group looks like a single transform */
+static size_t
+fused_transform(char const *in, size_t inLen, char *out, size_t outLen, size_t *used, void *state)
+{
+  struct fused *fused = state;
+  size_t took = 0, made = 0;
+  int progress;
+  do {
+        progress = 0;
+        /* From the last transform back, so each one makes room for the one before it */
+        for (size_t j = fused->count; j-- > 0; ) {
+          struct fused_buffer *from = j > 0 ? &fused->buffers[j - 1] : NULL;
+          struct fused_buffer *to = j + 1 < fused->count ? &fused->buffers[j] : NULL;
+          char const *src = from ? from->data + from->start : in + took;
+          size_t srcLen = from ? from->len : inLen - took;
+          if (to && to->start > 0) {
+            memmove(to->data, to->data + to->start, to->len);
+            to->start = 0;
+          }
+          char *dst = to ? to->data + to->len : out + made;
+          size_t dstLen = to ? FUSED_BUFFER - to->len : outLen - made;
+
+          /* With nothing to read, a transform only has something to write once everything before it has ended */
+          int ending = j > 0 ? fused->ended[j - 1] : inLen == 0;
+          if (dstLen == 0 || fused->ended[j] || (srcLen == 0 && !ending)) continue;
+          size_t n, wrote = fused->stages[j].transform(srcLen ? src : "", srcLen, dst, dstLen, &n, fused->stages[j].state);
+          if (srcLen == 0 && wrote == 0) fused->ended[j] = 1;
+
+          if (from) {
+            from->start += n;
+            from->len -= n;
+          } else {
+            took += n;
+          }
+          if (to) to->len += wrote;
+          else made += wrote;
+          if (n > 0 || wrote > 0 || fused->ended[j]) progress = 1;
+        }
+  } while (progress);
+  *used = took;
+  return made;
+}
+
+
+/* Move everything from in to out through transform, handing it pieces of the two rings
+ * directly so nothing is copied except by the transform itself */
+static void
+run_transform(struct fifo *in, struct fifo *out, pipeline_transform *transform, void *state)
+{
+  struct iovec from[2], to[2];
+  for (;;) {
+        ssize_t avail = fifo_read_peek(in, from, 1);
+        if (avail < 0) err(1, "fifo_read_peek");
+        if (avail == 0) break;
+        if (fifo_write_reserve(out, to, 1) == -1) err(1, "fifo_write_reserve");
+        size_t i = 0, j = 0, read = 0, written = 0;
+        while (i < 2 && from[i].iov_len > 0 && j < 2 && to[j].iov_len > 0) { /* Until one side runs out of pieces */
+          size_t used, made = transform(from[i].iov_base, from[i].iov_len, to[j].iov_base, to[j].iov_len, &used, state);
+          from[i].iov_base = (char *)from[i].iov_base + used;
+          from[i].iov_len -= used;
+          to[j].iov_base = (char *)to[j].iov_base + made;
+          to[j].iov_len -= made;
+          read += used;
+          written += made;
+          if (from[i].iov_len == 0) ++i;
+          if (to[j].iov_len == 0) ++j;
+        }
+        fifo_write_commit(out, written);
+        fifo_read_release(in, read);
+        /* About to wait on the input, so pass on what there is rather than hold it for the watermark */
+        if (fifo_read_avail(in) == 0) fifo_flush(out);
+  }
+  for (;;) {
+        if (fifo_write_reserve(out, to, 1) == -1) err(1, "fifo_write_reserve");
+        size_t used, made = transform("", 0, to[0].iov_base, to[0].iov_len, &used, state);
+        if (made == 0) break;
+        fifo_write_commit(out, made);
+  }
+}
+
+
+static void *
+group_thread(void *arg)
+{
+  struct group *group = arg;
+  struct pipeline_stage const *stage = &group->stages[0];
+  if (stage->run) {
+        stage->run(group->in, group->out, stage->state);
+  } else if (group->count == 1) {
+        run_transform(group->in, group->out, stage->transform, stage->state);
+  } else {
+        struct fused fused = {.stages = group->stages, .count = group->count};
+        fused.buffers = calloc(group->count - 1, sizeof *fused.buffers);
+        fused.ended = calloc(group->count, sizeof *fused.ended);
+        if (!fused.buffers || !fused.ended) err(1, "calloc");
+        for (size_t i = 0; i + 1 < group->count; ++i) {
+          if (!(fused.buffers[i].data = malloc(FUSED_BUFFER))) err(1, "malloc");
+        }
+        run_transform(group->in, group->out, fused_transform, &fused);
+        for (size_t i = 0; i + 1 < group->count; ++i) free(fused.buffers[i].data);
+        free(fused.buffers);
+        free(fused.ended);
+  }
+  fifo_close_read(group->in);
+  fifo_close_write(group->out);
+  return group;
+}
+
+
+void
+pipeline_run(struct pipeline_stage const *stages, size_t count)
+{
+  struct group *groups = calloc(count, sizeof *groups);
+  pthread_t *threads = calloc(count, sizeof *threads);
+  if (count > 0 && (!groups || !threads)) err(1, "calloc");
+
+  /* A thread for every stage but the transforms fused onto the one before them */
+  size_t n = 0;
+  for (size_t i = 0; i < count; ++i) {
+        if (!stages[i].transform == !stages[i].run) errx(1, "pipeline stage %s needs one of a transform or a run function", stages[i].name);
+        if (stages[i].transform && (i == 0 || i + 1 == count)) errx(1, "pipeline stage %s cannot transform without a fifo on either side", stages[i].name);
+        if (n > 0 && stages[i].fuse && stages[i].transform && groups[n - 1].stages[0].transform) {
+          ++groups[n - 1].count;
+        } else {
+          groups[n++] = (struct group) {.stages = &stages[i], .count = 1};
+        }
+  }
+
+  /* And a fifo between each thread and the next, as the last stage before it asks */
+  for (size_t g = 0; g + 1 < n; ++g) {
+        struct pipeline_stage const *last = &groups[g].stages[groups[g].count - 1];
+        size_t size = last->size ? last->size : PIPELINE_FIFO_SIZE;
+        size_t mark = last->mark ? last->mark : size / WAKE_DIVISOR;
+        struct fifo *fifo;
+        if (!fifo_create_mirrored(&fifo, size)) err(1, "fifo_create");
+        fifo_set_watermarks(fifo, mark, mark);
+        groups[g].out = fifo;
+        groups[g + 1].in = fifo;
+  }
+
+  for (size_t g = 0; g < n; ++g) {
+        if ((errno = pthread_create(&threads[g], NULL, group_thread, &groups[g]))) err(1, "pthread_create");
+  }
+  for (size_t g = 0; g < n; ++g) {
+        pthread_join(threads[g], NULL);
+  }
+  for (size_t g = 0; g + 1 < n; ++g) {
+        fifo_destroy(groups[g].out);
+  }
+  free(threads);
+  free(groups);
+}
@@ -0,0 +1,35 @@
+﻿#ifndef PIPELINE_H__
+#define PIPELINE_H__
+
+#include <stddef.h>
+#include "fifo.h"
+
+/* Bytes in a fifo between two stages unless the stage before it says otherwise */
+#define PIPELINE_FIFO_SIZE 65536
+
+/* Transforms a piece of one stage's input straight into a piece of its output, reading up
+ * to inLen bytes at in and writing up to outLen at out. Sets *used to the bytes it read and
+ * returns the bytes it wrote, one of which must be more than 0. Once the input has ended it
+ * is called with inLen 0 until it returns 0, to write out anything it held back */
+typedef size_t pipeline_transform(char const *in, size_t inLen, char *out, size_t outLen, size_t *used, void *state);
+
+/* Drives a stage's fifos itself, in being NULL for the first stage and out for the last.
+ * Both are closed once it returns */
+typedef void pipeline_run_fn(struct fifo *in, struct fifo *out, void *state);
+
+struct pipeline_stage {
+  char const *name;
+  pipeline_transform *transform;  /* Either the stage transforms the pieces handed to it, */
+  pipeline_run_fn *run;           /* or runs on its own, as the first and last stages must */
+  void *state;                    /* Handed to whichever of the two it has */
+  size_t size, mark;              /* Size and watermarks of the fifo after it, 0 for the defaults */
+  int fuse;                       /* Transform in the same thread as the transform before it */
+};
+
+/* Run count stages, each feeding the next through a fifo in a thread of its own, and return
+ * once they have all finished. A transform fused onto the one before it shares its thread,
+ * with the bytes between them going through a buffer instead of a fifo, which is cheaper
+ * when the handing over costs more than the transforms themselves */
+void pipeline_run(struct pipeline_stage const *stages, size_t count);
+
+#endif  //PIPELINE_H__
@@ -1,12 +1,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/types.h>  // ssize_t
 #include <sys/socket.h> // send(),recv()
+#include <sys/un.h>     // struct sockaddr_un
 #include <netdb.h>      // gethostbyname()
+#include <time.h>       // time()
+
+#include "otp_cipher.h"
+#include "otp_client.h"
+#include "otp_keypool.h"
+#include "otp_proto.h"
 
 /**
 * This program denotes the client side of a decryption service
@@ -69,16 +78,359 @@ int sendall(int sockDesc, char *buf, int *len)
   return n==-1?-1:0; //Return -1 on failure, 0 on success
 }
 
+/**
+ * Create a socket and connect it to the server on localhost, returning -1
+ * if the server is not there
+ */
+int connectServer(int portNumber)
+{
+  struct sockaddr_in serverAddress;
+
+  /* Create a socket */
+  int socketFD = socket(AF_INET, SOCK_STREAM, 0); 
+  if (socketFD < 0){ error("CLIENT: ERROR opening socket"); }
+
+  /* Set up the server address struct */
+  setupAddressStruct(&serverAddress, portNumber, "localhost");
+
+  /* Connect to server, leaving the error message to the caller */
+  if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
+  {
+    close(socketFD);
+    return -1;
+  }
+  return socketFD;
+}
+
+/* With -u the port argument names the server's Unix domain socket, and bulk
+ * messages go through memory shared with the server */
+int localMode = 0;
+
+/**
+ * Connect to the server's Unix domain socket at path, returning -1 if the
+ * server is not there
+ */
+int connectLocal(char const *path)
+{
+  struct sockaddr_un serverAddress;
+
+  memset(&serverAddress, 0, sizeof(serverAddress));
+  serverAddress.sun_family = AF_UNIX;
+  strncpy(serverAddress.sun_path, path, sizeof(serverAddress.sun_path) - 1);
+
+  int socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (socketFD < 0){ error("CLIENT: ERROR opening socket"); }
+  if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
+  {
+    close(socketFD);
+    return -1;
+  }
+  return socketFD;
+}
+
+/* Most servers the port argument may list */
+#define MAX_SERVERS 64
+
+/* Port of the server connected to, for the messages that name it */
+int serverPort = 0;
+
+/**
+ * Connect the way the command line asked for, to one of the servers in arg,
+ * a comma separated list of ports or, with -u, of socket paths. Starting from
+ * a random one spreads clients over the servers without them having to know
+ * each other's load, and a server that refuses is skipped for the next one.
+ * Prints the appropriate error message and exits if none of them answer
+ */
+int connectArg(char const *arg)
+{
+  char *names[MAX_SERVERS];
+  int count = 0;
+
+  char *list = strdup(arg);
+  for(char *name = strtok(list, ","); name != NULL && count < MAX_SERVERS; name = strtok(NULL, ","))
+  {
+    names[count++] = name;
+  }
+  if(count == 0) { names[count++] = list; }
+
+  srand(getpid() ^ time(NULL));
+  int start = rand() % count;
+  for(int i = 0; i < count; i++)
+  {
+    char const *name = names[(start + i) % count];
+    int socketFD = localMode ? connectLocal(name) : connectServer(atoi(name));
+    if(socketFD >= 0)
+    {
+      serverPort = atoi(name);
+      free(list);
+      return socketFD;
+    }
+  }
+
+  if(count > 1) { fprintf(stderr, "CLIENT: ERROR connecting to any of %s\n", arg); }
+  else if(localMode) { fprintf(stderr, "CLIENT: ERROR connecting to %s\n", arg); }
+  else { fprintf(stderr, "CLIENT: ERROR connecting to port %d\n", atoi(arg)); }
+  exit(2);
+}
+
+/* Attach a shared memory region for bulk messages when running locally, NULL otherwise */
+struct otp_shm *attachLocal(int socketFD, struct otp_shm *shm, size_t chunkSize)
+{
+  if(!localMode) { return NULL; }
+  if(otp_client_attach(socketFD, shm, chunkSize) != OTP_OK) { error("CLIENT: ERROR attaching shared memory"); }
+  return shm;
+}
+
+/**
+ * Stream the ciphertext and key to the server in chunks, validating them
+ * on the way, while the output is written to stdout as it comes back.
+ * The key starts keyOffset bytes into keyFD. Prints the appropriate error
+ * message and exits if anything goes wrong
+ */
+void streamBulk(FILE *textFile, int keyFD, off_t keyOffset, char *argv[], size_t chunkSize)
+{
+  struct otp_shm shm, *local = NULL;
+  struct stat textStat;
+  struct otp_job job;
+  int socketFD = connectArg(argv[3]);
+  int portNumber = serverPort;
+
+  /* A short message is sent inline, setting up shared memory would cost more than it saves */
+  if(fstat(fileno(textFile), &textStat) == 0 && textStat.st_size >= OTP_SHM_MIN)
+  {
+    local = attachLocal(socketFD, &shm, chunkSize);
+  }
+
+  /* Both files are read straight from their descriptors from the start */
+  fflush(stdout);
+  lseek(fileno(textFile), 0, SEEK_SET);
+  lseek(keyFD, 0, SEEK_SET);
+
+  job.textFD = fileno(textFile);
+  job.keyFD = keyFD;
+  job.outFD = STDOUT_FILENO;
+  job.keyOffset = keyOffset;
+  int status = otp_client_batch(socketFD, OTP_DECRYPT, &job, 1, chunkSize, local);
+  switch(status != OTP_OK ? status : job.status)
+  {
+    case OTP_OK:
+      break;
+    case OTP_BAD_TEXT:
+      fprintf(stderr, "Bad char detected in %s, exiting\n", argv[1]);
+      exit(1);
+    case OTP_BAD_KEY:
+      fprintf(stderr, "Bad char detected in %s, exiting\n", argv[2]);
+      exit(1);
+    case OTP_SHORT_KEY:
+      fprintf(stderr, "Cipher file longer than our key file, exiting\n");
+      exit(1);
+    case OTP_WRONG_SERVER:
+      fprintf(stderr, "Connected to the wrong server, exiting. Attempted port: %d\n", portNumber);
+      exit(2);
+    case OTP_REJECTED:
+      fprintf(stderr, "CLIENT: server rejected the message on port %d\n", portNumber);
+      exit(1);
+    default:
+      error("CLIENT: ERROR talking to server");
+  }
+  if(local) { otp_client_detach(local); }
+  close(socketFD);
+}
+
+/**
+ * Decrypt the ciphertext with the stretch of the key pool named where the key
+ * file would be that starts at offset, as printed by enc_client when it
+ * reserved it. Prints the appropriate error message and exits if anything
+ * goes wrong
+ */
+void streamPooled(FILE *textFile, char *argv[], unsigned long long offset, size_t chunkSize)
+{
+  struct otp_keypool *pool = otp_keypool_open(argv[2]);
+  if(pool == NULL)
+  {
+    fprintf(stderr, "Key pool %s could not be opened\n", argv[2]);
+    exit(1);
+  }
+  streamBulk(textFile, otp_keypool_fd(pool), OTP_KEYPOOL_HEADER + offset, argv, chunkSize);
+  otp_keypool_close(pool);
+}
+
+/* Messages opened and sent per otp_client_batch() call, which bounds the files held open */
+#define BATCH_GROUP 64
+
+/**
+ * Decrypt every message named in the list file over a single connection.
+ * Each line holds a ciphertext file, a key file and optionally an output
+ * file, separated by whitespace, and messages without an output file go
+ * to stdout in list order. Frames of later messages are sent while
+ * results of earlier ones are still coming back. A bad message is
+ * reported and skipped, and exits with 1 once the list is done
+ */
+void runBatch(char const *listName, char *argv[], size_t chunkSize)
+{
+  struct otp_job jobs[BATCH_GROUP];
+  char *names[BATCH_GROUP][2];
+  char *line = NULL;
+  size_t lineCap = 0;
+  struct otp_shm shm;
+  int portNumber;
+  int exitStatus = 0, lineNumber = 0, done = 0;
+
+  FILE *listFile = fopen(listName, "r");
+  if(listFile == NULL)
+  {
+    fprintf(stderr, "List file could not be opened\n");
+    exit(1);
+  }
+  int socketFD = connectArg(argv[1]);
+  portNumber = serverPort;
+  struct otp_shm *local = attachLocal(socketFD, &shm, chunkSize);
+  fflush(stdout);
+
+  while(!done)
+  {
+    /* Open the next group of messages */
+    int count = 0;
+    while(count < BATCH_GROUP)
+    {
+      if(getline(&line, &lineCap, listFile) < 0)
+      {
+        done = 1;
+        break;
+      }
+      lineNumber++;
+      char *textName = strtok(line, " \t\n");
+      char *keyName = strtok(NULL, " \t\n");
+      char *outName = strtok(NULL, " \t\n");
+      if(textName == NULL) { continue; }
+      if(keyName == NULL)
+      {
+        fprintf(stderr, "Line %d of %s has no key file, skipping it\n", lineNumber, listName);
+        exitStatus = 1;
+        continue;
+      }
+
+      struct otp_job *job = &jobs[count];
+      job->textFD = open(textName, O_RDONLY);
+      job->keyFD = open(keyName, O_RDONLY);
+      job->keyOffset = 0;
+      job->outFD = outName ? open(outName, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+      if(job->textFD < 0 || job->keyFD < 0 || job->outFD < 0)
+      {
+        fprintf(stderr, "Line %d of %s: %s could not be opened, skipping it\n", lineNumber, listName,
+                job->textFD < 0 ? textName : job->keyFD < 0 ? keyName : outName);
+        if(job->textFD >= 0) { close(job->textFD); }
+        if(job->keyFD >= 0) { close(job->keyFD); }
+        if(job->outFD >= 0 && job->outFD != STDOUT_FILENO) { close(job->outFD); }
+        exitStatus = 1;
+        continue;
+      }
+      names[count][0] = strdup(textName);
+      names[count][1] = strdup(keyName);
+      count++;
+    }
+    if(count == 0) { continue; }
+
+    switch(otp_client_batch(socketFD, OTP_DECRYPT, jobs, count, chunkSize, local))
+    {
+      case OTP_OK:
+        break;
+      case OTP_WRONG_SERVER:
+        fprintf(stderr, "Connected to the wrong server, exiting. Attempted port: %d\n", portNumber);
+        exit(2);
+      default:
+        error("CLIENT: ERROR talking to server");
+    }
+
+    /* Report the messages that failed and close everything for the next group */
+    for(int i = 0; i < count; i++)
+    {
+      switch(jobs[i].status)
+      {
+        case OTP_OK:
+          break;
+        case OTP_BAD_TEXT:
+          fprintf(stderr, "Bad char detected in %s, skipping it\n", names[i][0]);
+          break;
+        case OTP_BAD_KEY:
+          fprintf(stderr, "Bad char detected in %s, skipping it\n", names[i][1]);
+          break;
+        case OTP_SHORT_KEY:
+          fprintf(stderr, "%s is longer than its key %s, skipping it\n", names[i][0], names[i][1]);
+          break;
+        default:
+          fprintf(stderr, "CLIENT: server rejected %s on port %d\n", names[i][0], portNumber);
+      }
+      if(jobs[i].status != OTP_OK) { exitStatus = 1; }
+      close(jobs[i].textFD);
+      close(jobs[i].keyFD);
+      if(jobs[i].outFD != STDOUT_FILENO) { close(jobs[i].outFD); }
+      free(names[i][0]);
+      free(names[i][1]);
+    }
+  }
+
+  free(line);
+  fclose(listFile);
+  if(local) { otp_client_detach(local); }
+  close(socketFD);
+  exit(exitStatus);
+}
+
 int main(int argc, char *argv[]) {
-  int socketFD, portNumber, charsWritten, charsRead, bufLen;
+  int socketFD, charsWritten, charsRead, bufLen;
   int cipherChar, keyChar;
   FILE *cipherFile, *keyFile;
-  struct sockaddr_in serverAddress;
   char buffer[4];
+  int legacyMode = 0;
+  size_t chunkSize = OTP_CHUNK_SIZE;
+  char *listName = NULL;
+  char *poolOffset = NULL;
+  int opt;
+  static struct option longOptions[] = {
+    { "batch", required_argument, NULL, 'b' },
+    { NULL, 0, NULL, 0 }
+  };
 
-  /* Check usage & args */
-  if (argc < 4) { 
-    fprintf(stderr,"USAGE: %s ciphertext key port\n", argv[0]); 
+  /* Streaming bulk frames is the default, -l falls back to the legacy one character at a
+   * time protocol, -s changes how many characters are sent per frame and --batch sends
+   * every message in a list file over one connection. -u makes the port a Unix socket path,
+   * and a comma separated list of either names servers to spread clients over. With -k the
+   * key names a key pool and the key starts at the given offset in it */
+  while((opt = getopt_long(argc, argv, "lb:s:uk:", longOptions, NULL)) != -1)
+  {
+    if(opt == 'l') { legacyMode = 1; }
+    else if(opt == 'k') { poolOffset = optarg; }
+    else if(opt == 'u') { localMode = 1; }
+    else if(opt == 's') { chunkSize = strtoul(optarg, NULL, 10); }
+    else if(opt == 'b') { listName = optarg; }
+    else
+    {
+      fprintf(stderr,"USAGE: %s [-l] [-u] [-s chunksize] ciphertext key port[,port...]\n", argv[0]);
+      fprintf(stderr,"       %s [-u] [-s chunksize] -k offset ciphertext keypool port[,port...]\n", argv[0]);
+      fprintf(stderr,"       %s [-u] [-s chunksize] --batch listfile port[,port...]\n", argv[0]);
+      exit(0);
+    }
+  }
+  /* Shift the arguments so the positional ones stay at argv[1] through argv[3] */
+  argv[optind - 1] = argv[0];
+  argv += optind - 1;
+  argc -= optind - 1;
+
+  /* A batch only needs the port after the list file */
+  if(listName != NULL)
+  {
+    if(argc < 2)
+    {
+      fprintf(stderr,"USAGE: %s [-u] [-s chunksize] --batch listfile port[,port...]\n", argv[0]);
+      exit(0);
+    }
+    runBatch(listName, argv, chunkSize);
+  }
+
+  /* Check usage & args, a key pool only works with the bulk protocol */
+  if (argc < 4 || (poolOffset && legacyMode)) { 
+    fprintf(stderr,"USAGE: %s [-l] [-u] [-s chunksize] ciphertext key port[,port...]\n", argv[0]); 
     exit(0); 
   } 
   
@@ -90,6 +442,14 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
+  /* A key pool stands in for the key file, and running past its end is caught as a short key */
+  if(poolOffset)
+  {
+    streamPooled(cipherFile, argv, strtoull(poolOffset, NULL, 10), chunkSize);
+    fclose(cipherFile);
+    return 0;
+  }
+
   /* Open our keyFile for reading as well from argv[2] and exit if it is null */
   keyFile = fopen(argv[2], "r");
   if(keyFile == NULL)
@@ -109,6 +469,15 @@ int main(int argc, char *argv[]) {
     exit(1);
   }
 
+  /* Unless the legacy protocol was asked for, stream everything in a single pass and be done */
+  if(!legacyMode)
+  {
+    streamBulk(cipherFile, fileno(keyFile), 0, argv, chunkSize);
+    fclose(keyFile);
+    fclose(cipherFile);
+    return 0;
+  }
+
   /* Afterwards, reset the file pointers to the beginning to check for bar chars */
   fseek(cipherFile, 0, SEEK_SET);
   fseek(keyFile, 0, SEEK_SET);
@@ -137,18 +506,8 @@ int main(int argc, char *argv[]) {
   fseek(cipherFile, 0, SEEK_SET);
   fseek(keyFile, 0, SEEK_SET);
 
-  /* Create a socket and err if its return value is less than zero */
-  socketFD = socket(AF_INET, SOCK_STREAM, 0); 
-  if (socketFD < 0){ error("CLIENT: ERROR opening socket"); }
-
-  /* Set up the server address struct */
-  setupAddressStruct(&serverAddress, atoi(argv[3]), "localhost");
-
-  /* Connect to server and print the appropriate message to stderr if it fails then exit */
-  if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0){
-    fprintf(stderr, "CLIENT: ERROR connecting to port %d\n", atoi(argv[3]));
-    exit(2);
-  }
+  /* Connect to the server for the one character at a time protocol */
+  socketFD = connectArg(argv[3]);
 
   /* Before we enter the loop, null terminate the array */
   buffer[3] = '\0';
@@ -181,7 +540,7 @@ int main(int argc, char *argv[]) {
     /* Check for the identifier from the server indicating it connected to the wrong one then exit */
     if(buffer[2] == 'w')
     {
-      fprintf(stderr, "Connected to the wrong server, exiting. Attempted port: %d\n", atoi(argv[3]));
+      fprintf(stderr, "Connected to the wrong server, exiting. Attempted port: %d\n", serverPort);
       exit(2);
     }
 
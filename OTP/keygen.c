@@ -1,28 +1,154 @@
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/random.h>
 
-#define arrlen(x) (sizeof(x) / sizeof *(x))
+#include "otp_cipher.h"
+#include "otp_keypool.h"
+
+/**
+* This program writes a key of the requested length drawn from our
+* 27 character alphabet, followed by a newline, to stdout. The key
+* material comes from the kernel's CSPRNG through getrandom(), so two
+* keys generated at the same moment are never the same, and is written
+* a large block at a time, split across threads for huge keys. With -p
+* it writes a key pool instead, the pool header followed by the key with
+* no newline, for enc_client -k to reserve keys from
+*/
+
+/* Characters each thread generates per write */
+#define BLOCK_SIZE (1 << 20)
+
+/* Keys at least this long use every core unless -t says otherwise */
+#define THREAD_THRESHOLD (16 * BLOCK_SIZE)
+
+/* Random bytes below 243 = 9 * 27 map evenly onto the alphabet, the rest are
+ * rejected. Rejected bytes map to 0 so the loop below can skip them without branching */
+static unsigned char byteToChar[256];
+
+struct block {
+  char *out;
+  size_t len;
+};
+
+/* Fill a block with key characters. Random bytes land straight in the block and
+ * are mapped in place, then the gap left by rejected bytes is filled again */
+void *fillBlock(void *arg)
+{
+  struct block *blk = arg;
+  unsigned char *out = (unsigned char *)blk->out;
+  size_t have = 0;
+
+  while(have < blk->len)
+  {
+    ssize_t n = getrandom(out + have, blk->len - have, 0);
+    if(n < 0)
+    {
+      if(errno == EINTR) { continue; }
+      err(1, "getrandom");
+    }
+    size_t end = have + n;
+    for(size_t i = have; i < end; i++)
+    {
+      unsigned char c = byteToChar[out[i]];
+      out[have] = c;
+      have += (c != 0);
+    }
+  }
+  return NULL;
+}
+
+/* Write the whole buffer to stdout, looping on short writes */
+void writeAll(char const *buf, size_t len)
+{
+  while(len > 0)
+  {
+    ssize_t n = write(STDOUT_FILENO, buf, len);
+    if(n < 0)
+    {
+      if(errno == EINTR) { continue; }
+      err(1, "write");
+    }
+    buf += n;
+    len -= n;
+  }
+}
 
 int main(int argc, char *argv[])
 {
-  char alphabet[27] = {"ABCDEFGHIJKLMNOPQRSTUVWXYZ "};
-  if(argc < 2 || argc > 2)
+  long threads = 0;
+  int opt, badUsage = 0, pool = 0;
+
+  while((opt = getopt(argc, argv, "t:p")) != -1)
   {
-    fprintf(stderr, "USAGE: %s keyLength\n", argv[0]);
+    if(opt == 't') { threads = atol(optarg); }
+    else if(opt == 'p') { pool = 1; }
+    else { badUsage = 1; }
+  }
+  if(badUsage || optind != argc - 1)
+  {
+    fprintf(stderr, "USAGE: %s [-t threads] [-p] keyLength\n", argv[0]);
     exit(0);
   }
 
-  int keyLength = atoi(argv[1]);
-  int indexNum;
-  char toPrint;
-  srand(time(NULL)); //Initialize our random generator
-  
-  for(int i = 0; i<keyLength; i++)
+  long long keyLength = strtoll(argv[optind], NULL, 10);
+  if(keyLength < 0) { keyLength = 0; }
+
+  /* Only keys large enough to be worth it are spread across every core by default */
+  if(threads <= 0)
   {
-    indexNum = rand() % arrlen(alphabet);
-    toPrint = alphabet[indexNum];
-    fprintf(stdout, "%c", toPrint);
+    threads = 1;
+    if(keyLength >= THREAD_THRESHOLD)
+    {
+      threads = sysconf(_SC_NPROCESSORS_ONLN);
+      if(threads < 1) { threads = 1; }
+    }
   }
-  putc(10, stdout);
+
+  for(int i = 0; i < 243; i++) { byteToChar[i] = otp_alphabet[i % 27]; }
+  if(pool && otp_keypool_format(STDOUT_FILENO, keyLength) < 0) { err(1, "write"); }
+
+  /* Room for one block per thread plus the trailing newline */
+  char *buffer = malloc((size_t)threads * BLOCK_SIZE + 1);
+  struct block *blocks = calloc(threads, sizeof(*blocks));
+  pthread_t *tids = calloc(threads, sizeof(*tids));
+  if(buffer == NULL || blocks == NULL || tids == NULL) { err(1, "malloc"); }
+
+  unsigned long long remaining = keyLength;
+  do
+  {
+    /* Hand each thread up to one block of this round */
+    size_t roundLen = 0;
+    long used = 0;
+    for(; used < threads && remaining > 0; used++)
+    {
+      blocks[used].out = buffer + roundLen;
+      blocks[used].len = remaining < BLOCK_SIZE ? remaining : BLOCK_SIZE;
+      roundLen += blocks[used].len;
+      remaining -= blocks[used].len;
+    }
+
+    if(used == 1) { fillBlock(&blocks[0]); }
+    else
+    {
+      for(long i = 0; i < used; i++)
+      {
+        if((errno = pthread_create(&tids[i], NULL, fillBlock, &blocks[i]))) { err(1, "pthread_create"); }
+      }
+      for(long i = 0; i < used; i++) { pthread_join(tids[i], NULL); }
+    }
+
+    /* The newline goes out with the final block, a pool has none */
+    if(remaining == 0 && !pool) { buffer[roundLen++] = '\n'; }
+    writeAll(buffer, roundLen);
+  } while(remaining > 0);
+
+  free(tids);
+  free(blocks);
+  free(buffer);
+  return 0;
 }
@@ -0,0 +1,73 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "otp_local.h"
+#include "otp_proto.h"
+
+/**
+* This program encrypts or decrypts a file with a key right here, without
+* a server, and writes the result to stdout followed by a newline just
+* like enc_client and dec_client do. Large files are split across every
+* core
+*/
+
+int main(int argc, char *argv[])
+{
+  int threads = 0, mode = 0;
+  int opt, badUsage = 0;
+
+  /* The thread count is optional, the mode and both files are not */
+  while((opt = getopt(argc, argv, "t:")) != -1)
+  {
+    if(opt == 't') { threads = atoi(optarg); }
+    else { badUsage = 1; }
+  }
+  if(optind == argc - 3)
+  {
+    if(strcmp(argv[optind], "enc") == 0) { mode = OTP_ENCRYPT; }
+    else if(strcmp(argv[optind], "dec") == 0) { mode = OTP_DECRYPT; }
+  }
+  if(badUsage || mode == 0)
+  {
+    fprintf(stderr, "USAGE: %s [-t threads] enc|dec textfile key\n", argv[0]);
+    exit(1);
+  }
+  char const *textName = argv[optind + 1], *keyName = argv[optind + 2];
+
+  int textFD = open(textName, O_RDONLY);
+  if(textFD < 0)
+  {
+    fprintf(stderr, "%s could not be opened\n", textName);
+    exit(1);
+  }
+  int keyFD = open(keyName, O_RDONLY);
+  if(keyFD < 0)
+  {
+    fprintf(stderr, "%s could not be opened\n", keyName);
+    exit(1);
+  }
+
+  switch(otp_local_stream(mode, textFD, keyFD, STDOUT_FILENO, threads))
+  {
+    case OTP_OK:
+      break;
+    case OTP_BAD_TEXT:
+      fprintf(stderr, "Bad char detected in %s, exiting\n", textName);
+      exit(1);
+    case OTP_BAD_KEY:
+      fprintf(stderr, "Bad char detected in %s, exiting\n", keyName);
+      exit(1);
+    case OTP_SHORT_KEY:
+      fprintf(stderr, "%s is longer than its key %s, exiting\n", textName, keyName);
+      exit(1);
+    default:
+      perror("otp");
+      exit(1);
+  }
+  close(keyFD);
+  close(textFD);
+  return 0;
+}
@@ -0,0 +1,650 @@
+#include <errno.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "otp_async.h"
+#include "otp_cipher.h"
+#include "otp_client.h"
+#include "otp_proto.h"
+
+/* Most characters of a message sent per frame. Large enough that a big message
+ * is spread over the server's thread pool, small enough to bound what it buffers */
+#define FRAME_SIZE (16 << 20)
+
+/* Most connection events handled per call to epoll_wait() */
+#define MAX_EVENTS 64
+
+/* Milliseconds a server that could not be connected to is passed over for */
+#define DOWN_TIME 1000
+
+struct server {
+  struct sockaddr_storage address;
+  socklen_t addressLen;
+  size_t outstanding;            /* Messages queued on its connections */
+  long long downUntil;           /* Monotonic milliseconds it is passed over until */
+};
+
+/* A submitted message, owned by the connection it is queued on */
+struct request {
+  struct request *next;
+  int mode;
+  char const *text, *key;
+  char *out;
+  size_t len;
+  size_t framed;       /* Characters put in frames so far */
+  size_t received;     /* Characters of result that have arrived */
+  uint32_t id;
+  int status;
+  int tries;           /* Connections it has been lost with so far */
+  otp_async_done done;
+  void *arg;
+};
+
+struct conn {
+  int fd;                        /* -1 while closed */
+  int connecting;                /* Waiting for a non-blocking connect to finish */
+  int reused;                    /* Taken idle from the pool and nothing heard on it since, so the server may have hung up */
+  unsigned long openedIn;        /* Call to otp_async_poll() the descriptor was opened during */
+  uint32_t events;               /* What epoll watches the descriptor for */
+  struct server *server;
+  size_t queued;                 /* Messages queued on it */
+  struct request *head, *tail;   /* In the order their frames go out and their results come back */
+  struct request *sending;       /* First request with frames still to build, NULL if none */
+  struct otp_header sendHdr;
+  struct iovec iov[3];
+  int iovAt;                     /* First iovec of the frame still to send, 3 when there is none */
+  struct otp_header recvHdr;
+  size_t hdrHave;                /* Bytes of the current result header received */
+  size_t payloadLeft;            /* Bytes of the current result payload still to come */
+};
+
+struct
+otp_async {
+  int epollFD;
+  struct server *servers;
+  size_t serverCount;
+  struct conn *conns;            /* The connections of each server side by side */
+  size_t connCount;
+  size_t perServer;
+  unsigned int seed;             /* For picking servers at random */
+  size_t pending;
+  uint32_t nextID;
+  unsigned long polls;           /* Calls to otp_async_poll() so far */
+};
+
+
+/* Milliseconds on the monotonic clock */
+static long long
+now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+
+/* Resolve a server given the way otp_async_create() takes it, -1 if it cannot be */
+static int
+parse_server(char const *spec, struct server *server)
+{
+  struct addrinfo hints, *found;
+  char host[256] = "127.0.0.1";
+  char const *port = spec;
+
+  memset(server, 0, sizeof(*server));
+
+  /* A path names a Unix socket */
+  if(strchr(spec, '/'))
+  {
+    struct sockaddr_un *local = (struct sockaddr_un *)&server->address;
+    if(strlen(spec) >= sizeof(local->sun_path)) { return -1; }
+    local->sun_family = AF_UNIX;
+    strcpy(local->sun_path, spec);
+    server->addressLen = sizeof(*local);
+    return 0;
+  }
+
+  /* Otherwise a bare port is on the loopback address, like the port enc_client takes */
+  char const *colon = strrchr(spec, ':');
+  if(colon)
+  {
+    if((size_t)(colon - spec) >= sizeof(host)) { return -1; }
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+    port = colon + 1;
+  }
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = colon ? AF_UNSPEC : AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if(getaddrinfo(host, port, &hints, &found) != 0) { return -1; }
+  memcpy(&server->address, found->ai_addr, found->ai_addrlen);
+  server->addressLen = found->ai_addrlen;
+  freeaddrinfo(found);
+  return 0;
+}
+
+
+/* Have epoll watch for what the connection is waiting on, output only while connecting or with frames to send */
+static void
+conn_watch(struct otp_async *client, struct conn *c)
+{
+  uint32_t want = EPOLLIN;
+
+  if(c->connecting || c->sending || c->iovAt < 3) { want |= EPOLLOUT; }
+  if(want == c->events) { return; }
+  struct epoll_event ev = { .events = want, .data.ptr = c };
+  if(epoll_ctl(client->epollFD, EPOLL_CTL_MOD, c->fd, &ev) == 0) { c->events = want; }
+}
+
+
+/* Start connecting without waiting for it to finish, -1 if that fails right away */
+static int
+conn_open(struct otp_async *client, struct conn *c)
+{
+  struct sockaddr const *to = (struct sockaddr const *)&c->server->address;
+  int on = 1;
+
+  int fd = socket(to->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd < 0) { return -1; }
+  /* Frames are written whole, so there is nothing for Nagle to merge and only latency to add */
+  if(to->sa_family != AF_UNIX) { setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)); }
+  if(connect(fd, to, c->server->addressLen) < 0 && errno != EINPROGRESS)
+  {
+    close(fd);
+    return -1;
+  }
+
+  /* Whether it finished already or not, the first writable event says how it went */
+  struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = c };
+  if(epoll_ctl(client->epollFD, EPOLL_CTL_ADD, fd, &ev) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  c->fd = fd;
+  c->events = ev.events;
+  c->connecting = 1;
+  c->reused = 0;
+  c->openedIn = client->polls;
+  c->iovAt = 3;
+  c->hdrHave = 0;
+  c->payloadLeft = 0;
+  return 0;
+}
+
+
+/* Take a finished request off the front of its connection and tell the caller */
+static void
+finish(struct otp_async *client, struct conn *c)
+{
+  struct request *r = c->head;
+
+  c->head = r->next;
+  if(c->head == NULL) { c->tail = NULL; }
+  c->queued--;
+  c->server->outstanding--;
+  client->pending--;
+  r->done(r->arg, r->status);
+  free(r);
+}
+
+
+static int queue_request(struct otp_async *client, struct request *r, struct server const *avoid);
+
+/* Close the connection and move everything queued on it to other servers, failing
+ * with status those that have run out of servers to try. Returns how many failed.
+ * The queue is taken off first, so callbacks may queue new messages on the same connection.
+ * A pooled connection lost before anything came back on it was most likely closed by the
+ * server for being idle, so its messages are sent again without that counting as a try */
+static int
+conn_fail(struct otp_async *client, struct conn *c, int status)
+{
+  struct request *r = c->head;
+  int saved = errno, failed = 0, stale = c->reused && !c->connecting;
+
+  /* A server that cannot be connected to, or serves the other mode, is left alone for a while */
+  if(c->connecting || status == OTP_WRONG_SERVER) { c->server->downUntil = now_ms() + DOWN_TIME; }
+
+  close(c->fd);
+  c->fd = -1;
+  c->connecting = 0;
+  c->reused = 0;
+  c->head = c->tail = c->sending = NULL;
+  c->server->outstanding -= c->queued;
+  c->queued = 0;
+  while(r)
+  {
+    struct request *next = r->next;
+    /* Transforming holds no state on the server, so a message cut off partway is simply sent again in full */
+    if((!stale && ++r->tries >= (int)client->serverCount) || queue_request(client, r, stale ? NULL : c->server) < 0)
+    {
+      client->pending--;
+      errno = saved;
+      r->done(r->arg, status);
+      free(r);
+      failed++;
+    }
+    r = next;
+  }
+  return failed;
+}
+
+
+/* Point the iovecs at the next frame of the first request with frames left, straight out of its buffers */
+static void
+next_frame(struct conn *c)
+{
+  struct request *r = c->sending;
+  size_t len = r->len - r->framed;
+
+  if(len > FRAME_SIZE) { len = FRAME_SIZE; }
+  memset(&c->sendHdr, 0, sizeof(c->sendHdr));
+  c->sendHdr.magic = OTP_MAGIC;
+  c->sendHdr.type = r->mode;
+  c->sendHdr.flags = r->framed + len < r->len ? OTP_MORE : 0;
+  c->sendHdr.id = htonl(r->id);
+  c->sendHdr.length = htonl(len);
+
+  c->iov[0].iov_base = &c->sendHdr;
+  c->iov[0].iov_len = sizeof(c->sendHdr);
+  c->iov[1].iov_base = (void *)(r->text + r->framed);
+  c->iov[1].iov_len = len;
+  c->iov[2].iov_base = (void *)(r->key + r->framed);
+  c->iov[2].iov_len = len;
+  c->iovAt = 0;
+
+  /* A message of no characters still takes one empty frame */
+  r->framed += len;
+  if(r->framed == r->len) { c->sending = r->next; }
+}
+
+
+/* Send frames until the socket is full or there are none left. Returns OTP_OK or OTP_SYSTEM_ERROR */
+static int
+conn_send(struct conn *c)
+{
+  for(;;)
+  {
+    if(c->iovAt == 3 && c->sending) { next_frame(c); }
+    if(c->iovAt == 3) { return OTP_OK; }
+
+    struct msghdr msg = { .msg_iov = c->iov + c->iovAt, .msg_iovlen = 3 - c->iovAt };
+    ssize_t n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+    if(n < 0)
+    {
+      if(errno == EINTR) { continue; }
+      if(errno == EAGAIN || errno == EWOULDBLOCK) { return OTP_OK; }
+      return OTP_SYSTEM_ERROR;
+    }
+
+    /* Step past whatever the kernel took, which may end partway through an iovec */
+    while(n > 0 && c->iovAt < 3)
+    {
+      size_t step = (size_t)n < c->iov[c->iovAt].iov_len ? (size_t)n : c->iov[c->iovAt].iov_len;
+      c->iov[c->iovAt].iov_base = (char *)c->iov[c->iovAt].iov_base + step;
+      c->iov[c->iovAt].iov_len -= step;
+      n -= step;
+      if(c->iov[c->iovAt].iov_len == 0) { c->iovAt++; }
+    }
+    while(c->iovAt < 3 && c->iov[c->iovAt].iov_len == 0) { c->iovAt++; }
+  }
+}
+
+
+/* Check a result header against the request at the front, which results come back in the order of */
+static int
+check_header(struct conn *c)
+{
+  struct otp_header const *hdr = &c->recvHdr;
+  struct request *r = c->head;
+
+  if(hdr->magic != OTP_MAGIC || hdr->type == OTP_WRONG) { return OTP_WRONG_SERVER; }
+  c->payloadLeft = ntohl(hdr->length);
+  if(r == NULL || ntohl(hdr->id) != r->id || (hdr->type != OTP_RESULT && hdr->type != OTP_ERROR) ||
+     c->payloadLeft > r->len - r->received || (r == c->sending && !(hdr->flags & OTP_MORE)))
+  {
+    errno = EPROTO;
+    return OTP_SYSTEM_ERROR;
+  }
+  if(hdr->type == OTP_ERROR) { r->status = OTP_REJECTED; }
+  return OTP_OK;
+}
+
+
+/* Read results until the socket is drained, straight into the output of the
+ * requests they belong to, counting those that finish in *finished. Returns
+ * OTP_OK, or the result to fail the connection with */
+static int
+conn_recv(struct otp_async *client, struct conn *c, int *finished)
+{
+  for(;;)
+  {
+    ssize_t n;
+    if(c->hdrHave < sizeof(c->recvHdr))
+    {
+      n = recv(c->fd, (char *)&c->recvHdr + c->hdrHave, sizeof(c->recvHdr) - c->hdrHave, 0);
+    }
+    else { n = recv(c->fd, c->head->out + c->head->received, c->payloadLeft, 0); }
+    if(n == 0)
+    {
+      /* A server may hang up on a connection it has nothing for, which is only an error if something was */
+      errno = ECONNRESET;
+      return OTP_SYSTEM_ERROR;
+    }
+    if(n < 0)
+    {
+      if(errno == EINTR) { continue; }
+      if(errno == EAGAIN || errno == EWOULDBLOCK) { return OTP_OK; }
+      return OTP_SYSTEM_ERROR;
+    }
+    c->reused = 0;
+
+    if(c->hdrHave < sizeof(c->recvHdr))
+    {
+      c->hdrHave += n;
+      if(c->hdrHave < sizeof(c->recvHdr)) { continue; }
+      int status = check_header(c);
+      if(status != OTP_OK) { return status; }
+    }
+    else
+    {
+      c->head->received += n;
+      c->payloadLeft -= n;
+    }
+
+    if(c->payloadLeft == 0)
+    {
+      c->hdrHave = 0;
+      if(!(c->recvHdr.flags & OTP_MORE))
+      {
+        finish(client, c);
+        (*finished)++;
+      }
+    }
+  }
+}
+
+
+/* Handle what epoll reported for a connection, returning how many messages finished */
+static int
+conn_event(struct otp_async *client, struct conn *c, uint32_t events)
+{
+  int finished = 0, status = OTP_OK;
+
+  if(c->connecting)
+  {
+    int err = 0;
+    socklen_t errLen = sizeof(err);
+    if(!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) { return 0; }
+    if(getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &errLen) < 0) { err = errno; }
+    if(err != 0)
+    {
+      errno = err;
+      return conn_fail(client, c, OTP_SYSTEM_ERROR);
+    }
+    c->connecting = 0;
+  }
+
+  if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)) { status = conn_recv(client, c, &finished); }
+  if(status == OTP_OK) { status = conn_send(c); }
+  if(status != OTP_OK) { return finished + conn_fail(client, c, status); }
+  conn_watch(client, c);
+  return finished;
+}
+
+
+/* Whether a server may be picked right now */
+static int
+server_up(struct server const *server, struct server const *avoid, long long now)
+{
+  return server != avoid && server->downUntil <= now;
+}
+
+
+/* The index-th server that is up */
+static struct server *
+nth_up(struct otp_async *client, size_t index, struct server const *avoid, long long now)
+{
+  for(size_t i = 0; i < client->serverCount; i++)
+  {
+    if(server_up(&client->servers[i], avoid, now) && index-- == 0) { return &client->servers[i]; }
+  }
+  return NULL;
+}
+
+
+/**
+ * Pick the server for a message by two random choices: of two servers
+ * that are up, the one with fewer messages outstanding. That spreads the
+ * load nearly as evenly as always taking the least loaded server, without
+ * every message of a burst landing on the same one before its count goes
+ * up. When none is up, the one due back soonest is tried anyway, and the
+ * server to avoid only when it is the sole one
+ */
+static struct server *
+pick_server(struct otp_async *client, struct server const *avoid)
+{
+  long long now = now_ms();
+  size_t up = 0;
+
+  for(size_t i = 0; i < client->serverCount; i++) { up += server_up(&client->servers[i], avoid, now); }
+  if(up == 0)
+  {
+    struct server *soonest = NULL;
+    for(size_t i = 0; i < client->serverCount; i++)
+    {
+      struct server *server = &client->servers[i];
+      if(server == avoid && client->serverCount > 1) { continue; }
+      if(soonest == NULL || server->downUntil < soonest->downUntil) { soonest = server; }
+    }
+    return soonest;
+  }
+
+  size_t first = rand_r(&client->seed) % up;
+  if(up == 1) { return nth_up(client, first, avoid, now); }
+  size_t second = rand_r(&client->seed) % (up - 1);
+  if(second >= first) { second++; }
+  struct server *a = nth_up(client, first, avoid, now), *b = nth_up(client, second, avoid, now);
+  return b->outstanding < a->outstanding ? b : a;
+}
+
+
+/* The server's connection with the fewest messages queued, preferring one already open */
+static struct conn *
+pick_conn(struct otp_async *client, struct server *server)
+{
+  struct conn *conns = client->conns + (server - client->servers) * client->perServer;
+  struct conn *best = &conns[0];
+
+  for(size_t i = 1; i < client->perServer; i++)
+  {
+    struct conn *c = &conns[i];
+    if(c->queued < best->queued || (c->queued == best->queued && c->fd >= 0 && best->fd < 0)) { best = c; }
+  }
+  return best;
+}
+
+
+/* Queue a request from its start on a connection to the server picked for it, opening
+ * the connection if need be. A server that cannot even be connected to on the spot
+ * is passed over for the next one. Returns -1 once there is no server left to try */
+static int
+queue_request(struct otp_async *client, struct request *r, struct server const *avoid)
+{
+  for(;;)
+  {
+    struct server *server = pick_server(client, avoid);
+    struct conn *c = pick_conn(client, server);
+    if(c->fd >= 0 || conn_open(client, c) == 0)
+    {
+      if(c->head == NULL && !c->connecting) { c->reused = 1; }
+      r->next = NULL;
+      r->framed = 0;
+      r->received = 0;
+      r->status = OTP_OK;
+      if(c->tail) { c->tail->next = r; }
+      else { c->head = r; }
+      c->tail = r;
+      if(c->sending == NULL) { c->sending = r; }
+      c->queued++;
+      server->outstanding++;
+      conn_watch(client, c);
+      return 0;
+    }
+    server->downUntil = now_ms() + DOWN_TIME;
+    avoid = server;
+    if(++r->tries >= (int)client->serverCount) { return -1; }
+  }
+}
+
+
+struct otp_async *
+otp_async_create(char const *const *servers, size_t count, int conns)
+{
+  if(count == 0 || conns < 1)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  struct otp_async *client = calloc(1, sizeof(*client));
+  if(client == NULL) { return NULL; }
+  client->epollFD = -1;
+  client->servers = calloc(count, sizeof(*client->servers));
+  client->conns = calloc(count * conns, sizeof(*client->conns));
+  if(client->servers == NULL || client->conns == NULL)
+  {
+    otp_async_destroy(client);
+    return NULL;
+  }
+  client->serverCount = count;
+  client->connCount = count * conns;
+  client->perServer = conns;
+  client->seed = getpid() ^ now_ms();
+  for(size_t i = 0; i < client->connCount; i++)
+  {
+    client->conns[i].fd = -1;
+    client->conns[i].iovAt = 3;
+    client->conns[i].server = &client->servers[i / conns];
+  }
+
+  client->epollFD = epoll_create1(EPOLL_CLOEXEC);
+  if(client->epollFD < 0)
+  {
+    otp_async_destroy(client);
+    return NULL;
+  }
+  for(size_t i = 0; i < count; i++)
+  {
+    if(parse_server(servers[i], &client->servers[i]) < 0)
+    {
+      otp_async_destroy(client);
+      errno = EINVAL;
+      return NULL;
+    }
+  }
+  return client;
+}
+
+
+int
+otp_async_fd(struct otp_async const *client)
+{
+  return client->epollFD;
+}
+
+
+int
+otp_async_submit(struct otp_async *client, int mode, char const *text, char const *key, char *out,
+                 size_t len, otp_async_done done, void *arg)
+{
+  /* Bad input is caught here, where it costs nothing, rather than by the server */
+  if(mode != OTP_ENCRYPT && mode != OTP_DECRYPT)
+  {
+    errno = EINVAL;
+    return OTP_SYSTEM_ERROR;
+  }
+  if(otp_check(text, len) < len) { return OTP_BAD_TEXT; }
+  if(otp_check(key, len) < len) { return OTP_BAD_KEY; }
+
+  struct request *r = calloc(1, sizeof(*r));
+  if(r == NULL) { return OTP_SYSTEM_ERROR; }
+  r->mode = mode;
+  r->text = text;
+  r->key = key;
+  r->out = out;
+  r->len = len;
+  r->id = client->nextID++;
+  r->done = done;
+  r->arg = arg;
+
+  /* Only queued here, the frames go out once the connection reports it is writable */
+  if(queue_request(client, r, NULL) < 0)
+  {
+    free(r);
+    return OTP_SYSTEM_ERROR;
+  }
+  client->pending++;
+  return OTP_OK;
+}
+
+
+int
+otp_async_poll(struct otp_async *client, int timeout)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int finished = 0;
+
+  int n = epoll_wait(client->epollFD, events, MAX_EVENTS, timeout);
+  if(n < 0) { return errno == EINTR ? 0 : -1; }
+  client->polls++;
+  for(int i = 0; i < n; i++)
+  {
+    struct conn *c = events[i].data.ptr;
+    /* A callback may have closed it since, or even opened it again, and then
+     * the event was for the old descriptor. The new one reports its own next time */
+    if(c->fd < 0 || c->openedIn == client->polls) { continue; }
+    finished += conn_event(client, c, events[i].events);
+  }
+  return finished;
+}
+
+
+size_t
+otp_async_pending(struct otp_async const *client)
+{
+  return client->pending;
+}
+
+
+void
+otp_async_destroy(struct otp_async *client)
+{
+  for(size_t i = 0; client->conns && i < client->connCount; i++)
+  {
+    struct conn *c = &client->conns[i];
+    if(c->fd >= 0) { close(c->fd); }
+    while(c->head)
+    {
+      struct request *next = c->head->next;
+      free(c->head);
+      c->head = next;
+    }
+  }
+  if(client->epollFD >= 0) { close(client->epollFD); }
+  free(client->conns);
+  free(client->servers);
+  free(client);
+}
@@ -0,0 +1,63 @@
+#ifndef OTP_ASYNC_H__
+#define OTP_ASYNC_H__
+
+/* This header provides an asynchronous client for programs that want
+ * to encrypt and decrypt in memory messages without blocking or
+ * running enc_client once per message.
+ *
+ * A client keeps a pool of connections to one or more servers, opened
+ * without blocking the first time they are needed and kept for every
+ * message after that. Submitting a message only queues it on one of the
+ * connections. The caller then waits on a single descriptor alongside
+ * its own and calls otp_async_poll() whenever it is readable, which
+ * moves every connection along and calls each message's callback once
+ * its whole result is in.
+ *
+ * Each message is sent in frames of the bulk protocol pipelined on its
+ * connection behind the ones queued before it, straight out of and back
+ * into the caller's buffers, so nothing is copied on the client side.
+ *
+ * With several servers, each message goes to the less loaded of two
+ * picked at random, counting the messages outstanding on each. A server
+ * that refuses a connection or serves the other mode is passed over for
+ * a second, and the messages lost with a connection are sent again to
+ * another server until every server has been tried.
+ */
+
+#include <stddef.h>
+
+/* Called with the caller's argument and one of the OTP_ results of otp_client.h once a message is done.
+ * Its output buffer holds the result when the status is OTP_OK */
+typedef void (*otp_async_done)(void *arg, int status);
+
+struct otp_async;
+
+/* Set up a client for count servers, each given as a port on the loopback address,
+ * a host:port pair or the path of a Unix socket, keeping up to conns connections
+ * to each of them. Nothing is connected yet. Returns NULL if a server cannot be
+ * resolved or memory runs out */
+extern struct otp_async *otp_async_create(char const *const *servers, size_t count, int conns);
+
+/* Descriptor that becomes readable whenever otp_async_poll() has work to do */
+extern int otp_async_fd(struct otp_async const *client);
+
+/* Queue len characters of text and key to be transformed by mode (OTP_ENCRYPT or
+ * OTP_DECRYPT) into out. All three buffers must stay as they are until done is
+ * called. Returns OTP_OK once queued, in which case done is always called later,
+ * or the OTP_ result the message failed with right away, in which case it is not */
+extern int otp_async_submit(struct otp_async *client, int mode, char const *text, char const *key, char *out,
+                            size_t len, otp_async_done done, void *arg);
+
+/* Move every connection along, waiting up to timeout milliseconds (-1 for as long as
+ * it takes) for one of them to be ready, and call the callbacks of the messages that
+ * finish. Returns how many finished, or -1 if waiting failed */
+extern int otp_async_poll(struct otp_async *client, int timeout);
+
+/* Messages submitted whose callbacks have not been called yet */
+extern size_t otp_async_pending(struct otp_async const *client);
+
+/* Close every connection and free the client. Messages still pending are dropped without
+ * their callbacks being called. Must not be called from a callback */
+extern void otp_async_destroy(struct otp_async *client);
+
+#endif  //OTP_ASYNC_H__
@@ -0,0 +1,518 @@
+#define _GNU_SOURCE  // memfd_create()
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "otp_async.h"
+#include "otp_cipher.h"
+#include "otp_client.h"
+#include "otp_local.h"
+#include "otp_proto.h"
+
+/**
+* This program measures a running OTP server. For every message size in
+* the sweep it starts a number of concurrent clients that each send a
+* run of messages through the same client library enc_client and
+* dec_client use, then reports throughput, request latency percentiles
+* and connection setup cost as CSV or JSON, one row per size. Each row
+* also gives the single thread memcpy() rate for that size, the ceiling
+* a transport through shared memory can reach. With -L the clients call
+* the in process library instead, measuring the cipher with no server.
+* With -a a single thread keeps one message per client in flight through
+* the asynchronous client library, each client standing for a pooled
+* connection, and -i leaves each client idle for a while between its
+* messages, as long lived clients of a server often are
+*/
+
+/* Sizes swept when -s is not given */
+#define DEFAULT_SIZES "20,1K,64K,1M,16M,256M"
+
+/* Without -n each client sends about this many bytes per size, within the limits below */
+#define BYTES_PER_CLIENT (64 << 20)
+#define MIN_REQUESTS 1
+#define MAX_REQUESTS 1000
+
+/* Settings shared by every client thread */
+struct bench {
+  int port;
+  char const *path;      /* Unix socket to connect to instead of the port, NULL for TCP */
+  int shm;               /* Send through a shared memory region, only over a Unix socket */
+  int local;             /* Transform in process with otp_local_stream(), no server at all */
+  int async;             /* Drive every client from one thread through otp_async */
+  double idle;           /* Microseconds an asynchronous client waits between its messages */
+  char const *servers[64];  /* Servers as otp_async_create() takes them */
+  size_t serverCount;
+  int mode;              /* OTP_ENCRYPT or OTP_DECRYPT */
+  int persistent;        /* Send every message of a client over one connection */
+  size_t chunkSize;
+  int textFD, keyFD;     /* Message and key of the current size, in memory */
+  int nullFD;            /* Results are thrown away */
+  int requests;          /* Messages per client */
+};
+
+/* What one client measured, in microseconds */
+struct client {
+  pthread_t tid;
+  struct bench const *bench;
+  double *latency;       /* One per message */
+  double *connect;       /* One per connection */
+  int connects;
+  int errors;
+};
+
+
+/* Microseconds on the monotonic clock */
+double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Parse a size with an optional K, M or G suffix, 0 if it is not one */
+size_t parseSize(char const *str)
+{
+  char *end;
+  size_t size = strtoull(str, &end, 10);
+
+  if(*end == 'K' || *end == 'k') { size <<= 10; end++; }
+  else if(*end == 'M' || *end == 'm') { size <<= 20; end++; }
+  else if(*end == 'G' || *end == 'g') { size <<= 30; end++; }
+  return *end == '\0' ? size : 0;
+}
+
+/* Create an in memory file of len random alphabet characters, with a newline
+ * after them if asked, so the client maps it just like a file on disk */
+int memoryFile(char const *name, size_t len, int newline)
+{
+  int fd = memfd_create(name, MFD_CLOEXEC);
+  if(fd < 0 || ftruncate(fd, len + newline) < 0) { return -1; }
+  if(len + newline == 0) { return fd; }
+
+  char *map = mmap(NULL, len + newline, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED) { return -1; }
+  unsigned int seed = len;
+  for(size_t i = 0; i < len; i++) { map[i] = otp_alphabet[rand_r(&seed) % 27]; }
+  if(newline) { map[len] = '\n'; }
+  munmap(map, len + newline);
+  return fd;
+}
+
+/* Connect to the server on the loopback address or its Unix socket, recording how
+ * long it took, including attaching the shared memory region if one is used */
+int connectServer(struct client *cl, struct otp_shm *shm)
+{
+  struct sockaddr_in address;
+  struct sockaddr_un local;
+  struct sockaddr *to = (struct sockaddr *)&address;
+  socklen_t toLen = sizeof(address);
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(cl->bench->port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if(cl->bench->path)
+  {
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    strncpy(local.sun_path, cl->bench->path, sizeof(local.sun_path) - 1);
+    to = (struct sockaddr *)&local;
+    toLen = sizeof(local);
+  }
+
+  double start = now();
+  int fd = socket(to->sa_family, SOCK_STREAM, 0);
+  if(fd < 0) { return -1; }
+  if(connect(fd, to, toLen) < 0 ||
+     (cl->bench->shm && otp_client_attach(fd, shm, cl->bench->chunkSize) != OTP_OK))
+  {
+    close(fd);
+    return -1;
+  }
+  cl->connect[cl->connects++] = now() - start;
+  return fd;
+}
+
+/* Hang up, unmapping the connection's shared memory region if it has one */
+void disconnect(struct bench const *b, int socketFD, struct otp_shm *shm)
+{
+  if(b->shm) { otp_client_detach(shm); }
+  close(socketFD);
+}
+
+/* Send this client's run of messages, timing each from its first frame to its last result.
+ * Failed messages are counted but left out of the latencies */
+void *runClient(void *arg)
+{
+  struct client *cl = arg;
+  struct bench const *b = cl->bench;
+  struct otp_shm shm;
+  int socketFD = -1;
+
+  for(int i = 0; i < b->requests; i++)
+  {
+    if(b->local)
+    {
+      double start = now();
+      cl->latency[i] = otp_local_stream(b->mode, b->textFD, b->keyFD, b->nullFD, 0) == OTP_OK ? now() - start : NAN;
+      if(isnan(cl->latency[i])) { cl->errors++; }
+      continue;
+    }
+
+    if(socketFD < 0 && (socketFD = connectServer(cl, &shm)) < 0)
+    {
+      cl->errors++;
+      cl->latency[i] = NAN;
+      continue;
+    }
+
+    double start = now();
+    int status = otp_client_stream(socketFD, b->mode, b->textFD, b->keyFD, b->nullFD, b->chunkSize,
+                                   b->shm ? &shm : NULL);
+    cl->latency[i] = now() - start;
+    if(status != OTP_OK)
+    {
+      cl->errors++;
+      cl->latency[i] = NAN;
+    }
+
+    /* A failed message leaves the connection in an unknown state, so never reuse it */
+    if(!b->persistent || status != OTP_OK)
+    {
+      disconnect(b, socketFD, &shm);
+      socketFD = -1;
+    }
+  }
+  if(socketFD >= 0) { disconnect(b, socketFD, &shm); }
+  return NULL;
+}
+
+/* One client's message in flight through the asynchronous library */
+struct slot {
+  struct client *cl;
+  struct otp_async *async;
+  char const *text, *key;
+  char *out;
+  size_t size;
+  int sent;              /* Messages submitted so far */
+  double start;
+  double due;            /* When its next message goes out after sitting idle, 0 if it is not idle */
+};
+
+void submitNext(struct slot *s);
+
+/* Record how the message went and start the client's next one */
+void asyncDone(void *arg, int status)
+{
+  struct slot *s = arg;
+
+  s->cl->latency[s->sent - 1] = status == OTP_OK ? now() - s->start : NAN;
+  if(status != OTP_OK) { s->cl->errors++; }
+  if(s->cl->bench->idle > 0 && s->sent < s->cl->bench->requests) { s->due = now() + s->cl->bench->idle; }
+  else { submitNext(s); }
+}
+
+/* Submit the client's next message, counting any that fail to be queued at all */
+void submitNext(struct slot *s)
+{
+  struct bench const *b = s->cl->bench;
+
+  while(s->sent < b->requests)
+  {
+    s->start = now();
+    int status = otp_async_submit(s->async, b->mode, s->text, s->key, s->out, s->size, asyncDone, s);
+    s->sent++;
+    if(status == OTP_OK) { return; }
+    s->cl->latency[s->sent - 1] = NAN;
+    s->cl->errors++;
+  }
+}
+
+/* Run every client's messages through one asynchronous client from the calling thread,
+ * with a connection per client, returning once they are all done */
+void runAsync(struct bench const *b, struct client *clients, int count, size_t size)
+{
+  char const *text = "", *key = "";
+
+  /* The library takes messages in memory, so map the ones every client shares */
+  if(size > 0)
+  {
+    text = mmap(NULL, size, PROT_READ, MAP_SHARED, b->textFD, 0);
+    key = mmap(NULL, size, PROT_READ, MAP_SHARED, b->keyFD, 0);
+    if(text == MAP_FAILED || key == MAP_FAILED) { perror("mmap"); exit(1); }
+  }
+  struct otp_async *async = otp_async_create(b->servers, b->serverCount, count);
+  struct slot *slots = calloc(count, sizeof(*slots));
+  if(async == NULL || slots == NULL) { perror("otp_async_create"); exit(1); }
+
+  for(int i = 0; i < count; i++)
+  {
+    slots[i] = (struct slot){ .cl = &clients[i], .async = async, .text = text, .key = key, .size = size };
+    if(size > 0 && (slots[i].out = malloc(size)) == NULL) { perror("malloc"); exit(1); }
+    submitNext(&slots[i]);
+  }
+  for(;;)
+  {
+    /* Send the messages of clients done sitting idle, and wait no longer than until the next one is */
+    double next = 0, t = now();
+    for(int i = 0; i < count; i++)
+    {
+      if(slots[i].due > 0 && slots[i].due <= t)
+      {
+        slots[i].due = 0;
+        submitNext(&slots[i]);
+      }
+      else if(slots[i].due > 0 && (next == 0 || slots[i].due < next)) { next = slots[i].due; }
+    }
+    if(otp_async_pending(async) == 0 && next == 0) { break; }
+    /* With nothing in flight the client sleeps like an application with nothing to send,
+     * not hearing of connections the server hangs up on until it next uses them */
+    if(otp_async_pending(async) == 0)
+    {
+      usleep(next - t);
+      continue;
+    }
+    int timeout = next == 0 ? -1 : (int)((next - t) / 1000) + 1;
+    if(otp_async_poll(async, timeout) < 0) { perror("otp_async_poll"); exit(1); }
+  }
+
+  otp_async_destroy(async);
+  for(int i = 0; i < count; i++) { free(slots[i].out); }
+  free(slots);
+  if(size > 0)
+  {
+    munmap((void *)text, size);
+    munmap((void *)key, size);
+  }
+}
+
+/* MB/s of copying messages of size bytes with memcpy() on one thread, copying
+ * at least 256 MB in all and at most 16 MB of each message at a time */
+double memcpyRate(size_t size)
+{
+  size_t block = size < (16 << 20) ? size : (16 << 20);
+  if(block == 0) { return 0; }
+  char *from = malloc(block), *to = malloc(block);
+  if(from == NULL || to == NULL) { perror("malloc"); exit(1); }
+  memset(from, 'A', block);
+  memset(to, 0, block);
+
+  size_t copies = (256 << 20) / block + 1;
+  double start = now();
+  for(size_t i = 0; i < copies; i++)
+  {
+    memcpy(to, from, block);
+    __asm__ volatile("" : : "r"(to) : "memory");
+  }
+  double rate = copies * block / (now() - start);
+  free(from);
+  free(to);
+  return rate;
+}
+
+int compareDouble(void const *a, void const *b)
+{
+  double x = *(double const *)a, y = *(double const *)b;
+  return (x > y) - (x < y);
+}
+
+/* The p quantile of a sorted array, 0 if it is empty */
+double percentile(double const *sorted, size_t count, double p)
+{
+  if(count == 0) { return 0; }
+  size_t index = (size_t)ceil(p * count);
+  return sorted[index > 0 ? index - 1 : 0];
+}
+
+/* Gather every client's samples of one kind into a single sorted array, leaving out failed ones */
+size_t collect(struct client const *clients, int count, int connects, double *out)
+{
+  size_t n = 0;
+
+  for(int i = 0; i < count; i++)
+  {
+    int samples = connects ? clients[i].connects : clients[i].bench->requests;
+    double const *from = connects ? clients[i].connect : clients[i].latency;
+    for(int j = 0; j < samples; j++)
+    {
+      if(!isnan(from[j])) { out[n++] = from[j]; }
+    }
+  }
+  qsort(out, n, sizeof(*out), compareDouble);
+  return n;
+}
+
+int main(int argc, char *argv[])
+{
+  struct bench b = { .mode = OTP_ENCRYPT, .persistent = 0, .chunkSize = OTP_CHUNK_SIZE, .requests = 0 };
+  char const *sizes = DEFAULT_SIZES;
+  int clientCount = 1, json = 0, requests = 0;
+  int opt, badUsage = 0, local = 0;
+
+  while((opt = getopt(argc, argv, "m:c:n:s:k:puSLai:f:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'm':
+        if(strcmp(optarg, "enc") == 0) { b.mode = OTP_ENCRYPT; }
+        else if(strcmp(optarg, "dec") == 0) { b.mode = OTP_DECRYPT; }
+        else { badUsage = 1; }
+        break;
+      case 'c': clientCount = atoi(optarg); break;
+      case 'n': requests = atoi(optarg); break;
+      case 's': sizes = optarg; break;
+      case 'k': b.chunkSize = parseSize(optarg); break;
+      case 'p': b.persistent = 1; break;
+      case 'u': local = 1; break;
+      case 'S': b.shm = 1; break;
+      case 'L': b.local = 1; break;
+      case 'a': b.async = 1; break;
+      case 'i': b.idle = atof(optarg) * 1e6; break;
+      case 'f':
+        if(strcmp(optarg, "csv") == 0) { json = 0; }
+        else if(strcmp(optarg, "json") == 0) { json = 1; }
+        else { badUsage = 1; }
+        break;
+      default: badUsage = 1; break;
+    }
+  }
+  /* -u makes the port a Unix socket path, which -S needs to pass its shared memory over,
+   * and -L needs no server to talk to. -a sends inline over pooled connections of its own,
+   * which only it keeps idle between messages */
+  if(badUsage || optind != argc - !b.local || clientCount < 1 || (b.shm && !local) || (b.local && (local || b.shm)) ||
+     (b.async && (b.local || b.shm)) || (b.idle > 0 && !b.async))
+  {
+    fprintf(stderr, "USAGE: %s [-m enc|dec] [-c clients] [-n requests] [-s size,size,...] "
+                    "[-k chunksize] [-p] [-f csv|json] port\n", argv[0]);
+    fprintf(stderr, "       %s [options] -a [-u] [-i idleseconds] port[,port...]\n", argv[0]);
+    fprintf(stderr, "       %s [options] -u [-S] unixsocket\n", argv[0]);
+    fprintf(stderr, "       %s [options] -L\n", argv[0]);
+    exit(1);
+  }
+  if(local) { b.path = argv[optind]; }
+  else if(!b.local) { b.port = atoi(argv[optind]); }
+  char const *transport = b.local ? "local" : b.shm ? "shm" : local ? "unix" : "tcp";
+  if(b.async)
+  {
+    /* The messages are spread over every server in a comma separated list.
+     * otp_async tells a socket path from a port by its slash */
+    for(char *name = strtok(strdup(argv[optind]), ","); name && b.serverCount < 64; name = strtok(NULL, ","))
+    {
+      char *server = malloc(strlen(name) + 3);
+      if(server == NULL) { perror("malloc"); exit(1); }
+      sprintf(server, "%s%s", local && !strchr(name, '/') ? "./" : "", name);
+      b.servers[b.serverCount++] = server;
+    }
+    transport = local ? "async-unix" : "async-tcp";
+  }
+
+  b.nullFD = open("/dev/null", O_WRONLY);
+  if(b.nullFD < 0) { perror("open /dev/null"); exit(1); }
+
+  struct client *clients = calloc(clientCount, sizeof(*clients));
+  if(clients == NULL) { perror("calloc"); exit(1); }
+
+  if(json) { printf("["); }
+  else { printf("mode,transport,size,clients,requests,persistent,errors,seconds,mb_per_s,requests_per_s,"
+                "p50_us,p99_us,p999_us,connect_p50_us,connect_p99_us,memcpy_mb_per_s\n"); }
+
+  char *list = strdup(sizes);
+  int rows = 0;
+  for(char *item = strtok(list, ","); item != NULL; item = strtok(NULL, ","))
+  {
+    size_t size = parseSize(item);
+    if(size == 0 && strcmp(item, "0") != 0)
+    {
+      fprintf(stderr, "Bad size %s, skipping it\n", item);
+      continue;
+    }
+
+    /* Spread about the same amount of data over every size unless told otherwise */
+    b.requests = requests;
+    if(b.requests <= 0)
+    {
+      size_t fit = BYTES_PER_CLIENT / (size ? size : 1);
+      b.requests = fit < MIN_REQUESTS ? MIN_REQUESTS : fit > MAX_REQUESTS ? MAX_REQUESTS : fit;
+    }
+
+    b.textFD = memoryFile("otp_bench_text", size, 1);
+    b.keyFD = memoryFile("otp_bench_key", size, 1);
+    if(b.textFD < 0 || b.keyFD < 0) { perror("memfd"); exit(1); }
+
+    size_t samples = (size_t)clientCount * b.requests;
+    double *latency = calloc(samples, sizeof(*latency));
+    double *connect = calloc(samples, sizeof(*connect));
+    double *sorted = calloc(samples, sizeof(*sorted));
+    if(latency == NULL || connect == NULL || sorted == NULL) { perror("calloc"); exit(1); }
+
+    /* Every client starts at once, the clock covers the slowest of them */
+    double start = now();
+    for(int i = 0; i < clientCount; i++)
+    {
+      clients[i] = (struct client){ .bench = &b, .latency = latency + (size_t)i * b.requests,
+                                    .connect = connect + (size_t)i * b.requests };
+      if(b.async) { continue; }
+      if((errno = pthread_create(&clients[i].tid, NULL, runClient, &clients[i]))) { perror("pthread_create"); exit(1); }
+    }
+    if(b.async) { runAsync(&b, clients, clientCount, size); }
+    int errors = 0;
+    for(int i = 0; i < clientCount; i++)
+    {
+      if(!b.async) { pthread_join(clients[i].tid, NULL); }
+      errors += clients[i].errors;
+    }
+    double seconds = (now() - start) / 1e6;
+
+    size_t n = collect(clients, clientCount, 0, sorted);
+    double p50 = percentile(sorted, n, 0.50), p99 = percentile(sorted, n, 0.99), p999 = percentile(sorted, n, 0.999);
+    n = collect(clients, clientCount, 1, sorted);
+    double c50 = percentile(sorted, n, 0.50), c99 = percentile(sorted, n, 0.99);
+    double done = samples - errors;
+    double mbps = done * size / seconds / 1e6;
+    char const *mode = b.mode == OTP_ENCRYPT ? "enc" : "dec";
+    double copyRate = memcpyRate(size);
+
+    if(json)
+    {
+      printf("%s\n  {\"mode\": \"%s\", \"transport\": \"%s\", \"size\": %zu, \"clients\": %d, \"requests\": %d, "
+             "\"persistent\": %s, \"errors\": %d, \"seconds\": %.6f, \"mb_per_s\": %.3f, \"requests_per_s\": %.1f, "
+             "\"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f, \"connect_p50_us\": %.1f, \"connect_p99_us\": %.1f, "
+             "\"memcpy_mb_per_s\": %.3f}",
+             rows ? "," : "", mode, transport, size, clientCount, b.requests, b.persistent ? "true" : "false",
+             errors, seconds, mbps, done / seconds, p50, p99, p999, c50, c99, copyRate);
+    }
+    else
+    {
+      printf("%s,%s,%zu,%d,%d,%d,%d,%.6f,%.3f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.3f\n",
+             mode, transport, size, clientCount, b.requests, b.persistent, errors, seconds, mbps, done / seconds,
+             p50, p99, p999, c50, c99, copyRate);
+    }
+    fflush(stdout);
+    rows++;
+
+    close(b.textFD);
+    close(b.keyFD);
+    free(latency);
+    free(connect);
+    free(sorted);
+  }
+  if(json) { printf("\n]\n"); }
+
+  free(list);
+  free(clients);
+  close(b.nullFD);
+  return 0;
+}
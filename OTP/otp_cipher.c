@@ -0,0 +1,242 @@
+#include <stdatomic.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define OTP_X86 1
+#include <immintrin.h>
+#endif
+
+#include "otp_cipher.h"
+
+char const otp_alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ ";
+
+/* Written out in full, 16 byte values per row, with X marking bytes outside the alphabet */
+#define X OTP_BAD
+unsigned char const otp_index[256] = {
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+  26,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+  15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+   X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+};
+#undef X
+
+/* Every kernel transforms a whole buffer and returns -1 on a bad character */
+typedef int (*kernel_fn)(char *out, char const *text, char const *key, size_t len, int decrypt);
+
+/* Every checker returns the index of the first byte outside the alphabet, len if there is none */
+typedef size_t (*check_fn)(char const *buf, size_t len);
+
+
+/**
+ * Plain C kernel, also used for the tail of the buffer the vector
+ * kernels leave behind
+ */
+static int
+scalar_kernel(char *out, char const *text, char const *key, size_t len, int decrypt)
+{
+  for(size_t i = 0; i < len; i++)
+  {
+    unsigned textIndex = otp_index[(unsigned char)text[i]];
+    unsigned keyIndex = otp_index[(unsigned char)key[i]];
+    if(textIndex == OTP_BAD || keyIndex == OTP_BAD) { return -1; }
+
+    /* Both indecies are below 27 so a single subtraction brings the sum back in range */
+    unsigned sum = decrypt ? textIndex + 27 - keyIndex : textIndex + keyIndex;
+    if(sum >= 27) { sum -= 27; }
+    out[i] = otp_alphabet[sum];
+  }
+  return 0;
+}
+
+
+static size_t
+scalar_check(char const *buf, size_t len)
+{
+  for(size_t i = 0; i < len; i++)
+  {
+    if(otp_index[(unsigned char)buf[i]] == OTP_BAD) { return i; }
+  }
+  return len;
+}
+
+
+#ifdef OTP_X86
+/*
+ * The vector kernels work on unsigned bytes:
+ *   - a letter's index is c - 'A', which is below 26 only for letters, and a space is 26
+ *   - the sum of two indecies is at most 53, and sum - 27 wraps around to something
+ *     larger than sum when sum < 27, so min(sum, sum - 27) is the sum modulo 27
+ *   - decryption adds 27 to the difference first so it never goes negative
+ *   - index 26 turns back into a space and every other index into index + 'A'
+ */
+
+/* Map 16 characters to alphabet indecies, clearing bytes of good for characters outside it */
+__attribute__((target("sse2"))) static inline __m128i
+index_sse2(__m128i c, __m128i *good)
+{
+  __m128i t = _mm_sub_epi8(c, _mm_set1_epi8('A'));
+  __m128i letter = _mm_cmpeq_epi8(_mm_min_epu8(t, _mm_set1_epi8(25)), t);
+  __m128i space = _mm_cmpeq_epi8(c, _mm_set1_epi8(' '));
+  *good = _mm_and_si128(*good, _mm_or_si128(letter, space));
+  return _mm_or_si128(_mm_and_si128(letter, t), _mm_and_si128(space, _mm_set1_epi8(26)));
+}
+
+__attribute__((target("sse2"))) static int
+sse2_kernel(char *out, char const *text, char const *key, size_t len, int decrypt)
+{
+  __m128i const n27 = _mm_set1_epi8(27);
+  __m128i good = _mm_set1_epi8(-1);
+  size_t i = 0;
+
+  for(; i + 16 <= len; i += 16)
+  {
+    __m128i t = index_sse2(_mm_loadu_si128((__m128i const *)(text + i)), &good);
+    __m128i k = index_sse2(_mm_loadu_si128((__m128i const *)(key + i)), &good);
+    __m128i sum = decrypt ? _mm_add_epi8(_mm_sub_epi8(t, k), n27) : _mm_add_epi8(t, k);
+    sum = _mm_min_epu8(sum, _mm_sub_epi8(sum, n27));
+
+    __m128i space = _mm_cmpeq_epi8(sum, _mm_set1_epi8(26));
+    __m128i c = _mm_or_si128(_mm_and_si128(space, _mm_set1_epi8(' ')),
+                             _mm_andnot_si128(space, _mm_add_epi8(sum, _mm_set1_epi8('A'))));
+    _mm_storeu_si128((__m128i *)(out + i), c);
+  }
+  if(_mm_movemask_epi8(good) != 0xffff) { return -1; }
+  return scalar_kernel(out + i, text + i, key + i, len - i, decrypt);
+}
+
+__attribute__((target("sse2"))) static size_t
+sse2_check(char const *buf, size_t len)
+{
+  size_t i = 0;
+
+  for(; i + 16 <= len; i += 16)
+  {
+    __m128i good = _mm_set1_epi8(-1);
+    index_sse2(_mm_loadu_si128((__m128i const *)(buf + i)), &good);
+    unsigned mask = _mm_movemask_epi8(good);
+    if(mask != 0xffff) { return i + __builtin_ctz(~mask); }
+  }
+  return i + scalar_check(buf + i, len - i);
+}
+
+/* Same as index_sse2() but for 32 characters */
+__attribute__((target("avx2"))) static inline __m256i
+index_avx2(__m256i c, __m256i *good)
+{
+  __m256i t = _mm256_sub_epi8(c, _mm256_set1_epi8('A'));
+  __m256i letter = _mm256_cmpeq_epi8(_mm256_min_epu8(t, _mm256_set1_epi8(25)), t);
+  __m256i space = _mm256_cmpeq_epi8(c, _mm256_set1_epi8(' '));
+  *good = _mm256_and_si256(*good, _mm256_or_si256(letter, space));
+  return _mm256_or_si256(_mm256_and_si256(letter, t), _mm256_and_si256(space, _mm256_set1_epi8(26)));
+}
+
+__attribute__((target("avx2"))) static int
+avx2_kernel(char *out, char const *text, char const *key, size_t len, int decrypt)
+{
+  __m256i const n27 = _mm256_set1_epi8(27);
+  __m256i good = _mm256_set1_epi8(-1);
+  size_t i = 0;
+
+  for(; i + 32 <= len; i += 32)
+  {
+    __m256i t = index_avx2(_mm256_loadu_si256((__m256i const *)(text + i)), &good);
+    __m256i k = index_avx2(_mm256_loadu_si256((__m256i const *)(key + i)), &good);
+    __m256i sum = decrypt ? _mm256_add_epi8(_mm256_sub_epi8(t, k), n27) : _mm256_add_epi8(t, k);
+    sum = _mm256_min_epu8(sum, _mm256_sub_epi8(sum, n27));
+
+    __m256i space = _mm256_cmpeq_epi8(sum, _mm256_set1_epi8(26));
+    __m256i c = _mm256_blendv_epi8(_mm256_add_epi8(sum, _mm256_set1_epi8('A')), _mm256_set1_epi8(' '), space);
+    _mm256_storeu_si256((__m256i *)(out + i), c);
+  }
+  if(_mm256_movemask_epi8(good) != -1) { return -1; }
+  return sse2_kernel(out + i, text + i, key + i, len - i, decrypt);
+}
+
+__attribute__((target("avx2"))) static size_t
+avx2_check(char const *buf, size_t len)
+{
+  size_t i = 0;
+
+  for(; i + 32 <= len; i += 32)
+  {
+    __m256i good = _mm256_set1_epi8(-1);
+    index_avx2(_mm256_loadu_si256((__m256i const *)(buf + i)), &good);
+    unsigned mask = _mm256_movemask_epi8(good);
+    if(mask != 0xffffffffu) { return i + __builtin_ctz(~mask); }
+  }
+  return i + sse2_check(buf + i, len - i);
+}
+#endif
+
+
+/* A kernel together with the check that goes with it */
+struct kernel {
+  char const *name;
+  kernel_fn transform;
+  check_fn check;
+};
+
+static struct kernel const scalar = { "scalar", scalar_kernel, scalar_check };
+#ifdef OTP_X86
+static struct kernel const sse2 = { "sse2", sse2_kernel, sse2_check };
+static struct kernel const avx2 = { "avx2", avx2_kernel, avx2_check };
+#endif
+
+/* Chosen on first use and published through one atomic pointer, so threads
+ * racing to choose it only ever see a whole choice, and all make the same one */
+static struct kernel const *_Atomic chosen;
+
+static struct kernel const *
+pick_kernel(void)
+{
+  struct kernel const *picked = atomic_load_explicit(&chosen, memory_order_acquire);
+  if(picked) { return picked; }
+  picked = &scalar;
+#ifdef OTP_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) { picked = &avx2; }
+  else if(__builtin_cpu_supports("sse2")) { picked = &sse2; }
+#endif
+  atomic_store_explicit(&chosen, picked, memory_order_release);
+  return picked;
+}
+
+
+int
+otp_encrypt(char *out, char const *plain, char const *key, size_t len)
+{
+  return pick_kernel()->transform(out, plain, key, len, 0);
+}
+
+
+int
+otp_decrypt(char *out, char const *cipher, char const *key, size_t len)
+{
+  return pick_kernel()->transform(out, cipher, key, len, 1);
+}
+
+
+size_t
+otp_check(char const *buf, size_t len)
+{
+  return pick_kernel()->check(buf, len);
+}
+
+
+char const *
+otp_cipher_kernel(void)
+{
+  return pick_kernel()->name;
+}
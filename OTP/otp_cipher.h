@@ -0,0 +1,36 @@
+#ifndef OTP_CIPHER_H__
+#define OTP_CIPHER_H__
+
+/* This header provides the modular 27 one time pad cipher shared by
+ * the encryption and decryption servers.
+ *
+ * Characters are mapped to their alphabet index through a 256 entry
+ * table instead of a scan of the alphabet, and whole buffers are
+ * transformed at once. On x86 the buffers are processed 16 or 32 bytes
+ * at a time with SSE2 or AVX2, picked at runtime from what the CPU
+ * supports, with a scalar loop everywhere else.
+ */
+
+#include <stddef.h>
+
+/* The 27 characters of the alphabet in index order */
+extern char const otp_alphabet[];
+
+/* Alphabet index of every byte value, OTP_BAD for bytes outside the alphabet */
+#define OTP_BAD 0xff
+extern unsigned char const otp_index[256];
+
+/* Add (encrypt) or subtract (decrypt) the key from len characters of text
+ * modulo 27, writing len characters to out. out may be the same buffer as
+ * text. Returns -1 if either input holds a character outside the alphabet */
+extern int otp_encrypt(char *out, char const *plain, char const *key, size_t len);
+extern int otp_decrypt(char *out, char const *cipher, char const *key, size_t len);
+
+/* Index of the first byte of buf outside the alphabet, len if there is none.
+ * Uses the same vector kernels, so validating costs next to nothing */
+extern size_t otp_check(char const *buf, size_t len);
+
+/* Name of the kernel the cipher picked for this CPU: "avx2", "sse2" or "scalar" */
+extern char const *otp_cipher_kernel(void);
+
+#endif  //OTP_CIPHER_H__
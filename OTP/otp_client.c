@@ -0,0 +1,602 @@
+#define _GNU_SOURCE  // memfd_create(), F_ADD_SEALS
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "otp_cipher.h"
+#include "otp_client.h"
+#include "otp_proto.h"
+
+
+/* Read until len bytes arrive or the file ends, returning how many arrived or -1 */
+static ssize_t
+read_full(int fd, char *buf, size_t len)
+{
+  size_t total = 0;
+
+  while(total < len)
+  {
+    ssize_t n = read(fd, buf + total, len - total);
+    if(n < 0)
+    {
+      if(errno == EINTR) { continue; }
+      return -1;
+    }
+    if(n == 0) { break; }
+    total += n;
+  }
+  return total;
+}
+
+
+/* Write all len bytes, returning -1 on failure */
+static int
+write_full(int fd, char const *buf, size_t len)
+{
+  while(len > 0)
+  {
+    ssize_t n = write(fd, buf, len);
+    if(n < 0)
+    {
+      if(errno == EINTR) { continue; }
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+
+
+/* Where the text and key of the message being sent come from. Regular files
+ * are mapped into memory so frames are sent straight out of the page cache,
+ * anything else is read into a buffer one chunk at a time */
+struct source {
+  int textFD, keyFD;
+  char const *textMap, *keyMap;   /* NULL when reading instead */
+  size_t textSize, keySize;       /* Length of each mapping */
+  size_t keySkip;                 /* Bytes of the key mapping in front of the key itself */
+  size_t pos;                     /* Offset of the next chunk in both files */
+  size_t released;                /* Mapped bytes below this have been handed back */
+  char *buf;                      /* Read buffer kept for every message, a text chunk followed by a key chunk */
+};
+
+
+/* Map a whole regular file read only, NULL if it is empty or cannot be mapped */
+static char const *
+map_file(int fd, size_t *size)
+{
+  struct stat st;
+
+  if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) { return NULL; }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(map == MAP_FAILED) { return NULL; }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  *size = st.st_size;
+  return map;
+}
+
+
+/* Start reading a message's files, allocating the read buffer the first time
+ * a file cannot be mapped. Returns -1 if memory runs out or the key cannot be reached */
+static int
+open_source(struct source *src, struct otp_job const *job, size_t chunkSize)
+{
+  src->textFD = job->textFD;
+  src->keyFD = job->keyFD;
+  src->textMap = map_file(job->textFD, &src->textSize);
+  src->keyMap = map_file(job->keyFD, &src->keySize);
+  src->keySkip = 0;
+  src->pos = 0;
+  src->released = 0;
+
+  /* A key further into its file is skipped to, whole file mapped or not */
+  if(job->keyOffset > 0)
+  {
+    if(src->keyMap) { src->keySkip = (size_t)job->keyOffset < src->keySize ? (size_t)job->keyOffset : src->keySize; }
+    else if(lseek(job->keyFD, job->keyOffset, SEEK_SET) < 0) { return -1; }
+  }
+
+  if((!src->textMap || !src->keyMap) && src->buf == NULL)
+  {
+    src->buf = malloc(2 * chunkSize);
+    if(src->buf == NULL) { return -1; }
+  }
+  return 0;
+}
+
+
+/* Unmap a message's files once its last frame is out */
+static void
+close_source(struct source *src)
+{
+  if(src->textMap) { munmap((void *)src->textMap, src->textSize); }
+  if(src->keyMap) { munmap((void *)src->keyMap, src->keySize); }
+  src->textMap = NULL;
+  src->keyMap = NULL;
+}
+
+
+/**
+ * Find the next chunk of text and the matching stretch of key, stopping
+ * early at the first newline of either, and point the frame's iovecs at
+ * them. Validation happens in this same pass, right before the chunk is
+ * sent. Sets *last once the text is used up. Returns OTP_OK or one of the
+ * other OTP_ results
+ */
+static int
+next_frame(struct source *src, struct otp_header *hdr, struct iovec *iov, int mode,
+           uint32_t id, size_t chunkSize, int *last)
+{
+  char const *text, *key;
+  size_t textLen, keyLen;
+
+  if(src->textMap)
+  {
+    text = src->textMap + src->pos;
+    textLen = src->textSize - src->pos;
+    if(textLen > chunkSize) { textLen = chunkSize; }
+    if(src->pos + textLen == src->textSize) { *last = 1; }
+  }
+  else
+  {
+    ssize_t n = read_full(src->textFD, src->buf, chunkSize);
+    if(n < 0) { return OTP_SYSTEM_ERROR; }
+    text = src->buf;
+    textLen = n;
+    if(textLen < chunkSize) { *last = 1; }
+  }
+  /* One scan of each block both validates it and finds the newline ending the text */
+  size_t stop = otp_check(text, textLen);
+  if(stop < textLen)
+  {
+    if(text[stop] != '\n') { return OTP_BAD_TEXT; }
+    textLen = stop;
+    *last = 1;
+  }
+
+  if(src->keyMap)
+  {
+    size_t at = src->keySkip + src->pos;
+    key = src->keyMap + at;
+    keyLen = at < src->keySize ? src->keySize - at : 0;
+    if(keyLen > textLen) { keyLen = textLen; }
+  }
+  else
+  {
+    ssize_t n = read_full(src->keyFD, src->buf + chunkSize, textLen);
+    if(n < 0) { return OTP_SYSTEM_ERROR; }
+    key = src->buf + chunkSize;
+    keyLen = n;
+  }
+  stop = otp_check(key, keyLen);
+  if(stop < keyLen)
+  {
+    if(key[stop] != '\n') { return OTP_BAD_KEY; }
+    keyLen = stop;
+  }
+  if(keyLen < textLen) { return OTP_SHORT_KEY; }
+  src->pos += textLen;
+
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->magic = OTP_MAGIC;
+  hdr->type = mode;
+  hdr->flags = *last ? 0 : OTP_MORE;
+  hdr->id = htonl(id);
+  hdr->length = htonl(textLen);
+
+  /* The frame goes out as header, text and key without being copied together first */
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof(*hdr);
+  iov[1].iov_base = (void *)text;
+  iov[1].iov_len = textLen;
+  iov[2].iov_base = (void *)key;
+  iov[2].iov_len = textLen;
+  return OTP_OK;
+}
+
+
+/* Point the iovecs at a bare OTP_ERROR frame telling the server the message
+ * with this id is being abandoned partway through */
+static void
+abort_frame(struct otp_header *hdr, struct iovec *iov, int mode, uint32_t id)
+{
+  memset(hdr, 0, sizeof(*hdr));
+  hdr->magic = OTP_MAGIC;
+  hdr->type = OTP_ERROR;
+  hdr->status = mode;
+  hdr->id = htonl(id);
+
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof(*hdr);
+  iov[1].iov_len = 0;
+  iov[2].iov_len = 0;
+}
+
+
+/**
+ * Turn a frame built by next_frame() into one that refers to its slot of the
+ * shared region, where the key has to follow the text directly. Blocks read
+ * from a pipe were already read into the slot and the key only moves for a
+ * short last chunk, blocks from a mapped file are copied there
+ */
+static void
+shm_frame(struct otp_shm const *shm, char *slot, struct otp_header *hdr, struct iovec *iov, uint64_t *offset)
+{
+  size_t len = iov[1].iov_len;
+
+  if(iov[1].iov_base != slot) { memcpy(slot, iov[1].iov_base, len); }
+  if(iov[2].iov_base == slot + shm->chunkSize) { memmove(slot + len, iov[2].iov_base, len); }
+  else { memcpy(slot + len, iov[2].iov_base, len); }
+
+  *offset = htobe64(slot - shm->base);
+  hdr->flags |= OTP_SHM;
+  iov[1].iov_base = offset;
+  iov[1].iov_len = sizeof(*offset);
+  iov[2].iov_len = 0;
+}
+
+
+/* Hand back the pages of the mappings that have been sent so memory use stays flat */
+static void
+release_sent(struct source *src)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t upTo = src->pos / page * page;
+
+  if(upTo <= src->released) { return; }
+  if(src->textMap) { madvise((void *)(src->textMap + src->released), upTo - src->released, MADV_DONTNEED); }
+
+  /* The key need not start on a page, so only the pages it has wholly moved past go */
+  size_t keyFrom = (src->keySkip + src->released) / page * page;
+  size_t keyTo = (src->keySkip + upTo) / page * page;
+  if(src->keyMap && keyTo > keyFrom && keyTo <= src->keySize)
+  {
+    madvise((void *)(src->keyMap + keyFrom), keyTo - keyFrom, MADV_DONTNEED);
+  }
+  src->released = upTo;
+}
+
+
+int
+otp_client_batch(int sockDesc, int mode, struct otp_job *jobs, size_t count, size_t chunkSize,
+                 struct otp_shm const *shm)
+{
+  struct otp_header hdr, sendHdr;
+  struct iovec iov[3];
+  struct source src;
+  size_t sendJob = 0;        /* Message whose frames are being sent, used as its request id */
+  size_t doneJobs = 0;       /* Messages below this have had their last result */
+  size_t hdrHave = 0;        /* Bytes of the current result header received */
+  size_t payloadLeft = 0;    /* Bytes of the current result payload still to come */
+  uint32_t recvJob = 0;      /* Message the current result belongs to */
+  size_t sentFrames = 0, recvFrames = 0;  /* Results come back in order, so these pick the shared memory slots */
+  uint64_t sendOffset;       /* Payload of a shared memory frame */
+  int iovAt = 3;             /* First iovec of the frame still to send, 3 when there is none */
+  int sourceOpen = 0, last = 0, outstanding = 0;
+  int status = OTP_OK;
+  char *recvBuf = NULL;
+
+  if(chunkSize == 0 || chunkSize > OTP_MAX_PAYLOAD) { chunkSize = OTP_CHUNK_SIZE; }
+  if(shm) { chunkSize = shm->chunkSize; }
+  for(size_t i = 0; i < count; i++) { jobs[i].status = OTP_OK; }
+  memset(&src, 0, sizeof(src));
+
+  /* Besides the read buffer, one chunk of results is all that is ever held */
+  recvBuf = malloc(chunkSize);
+  if(recvBuf == NULL)
+  {
+    status = OTP_SYSTEM_ERROR;
+    goto end;
+  }
+
+  /* Sending and receiving overlap, so neither side ever blocks the other */
+  int flags = fcntl(sockDesc, F_GETFL);
+  if(flags < 0 || fcntl(sockDesc, F_SETFL, flags | O_NONBLOCK) < 0)
+  {
+    status = OTP_SYSTEM_ERROR;
+    goto end;
+  }
+
+  while(sendJob < count || iovAt < 3 || outstanding > 0)
+  {
+    /* Build the next frame once the last one is out, as long as the window has room.
+     * The window spans messages, so later messages go out while earlier results are on their way */
+    if(iovAt == 3 && sendJob < count && outstanding < OTP_WINDOW)
+    {
+      /* Through shared memory, blocks that have to be read are read straight into the free slot */
+      char *slot = NULL;
+      if(shm)
+      {
+        slot = shm->base + sentFrames % OTP_WINDOW * 2 * chunkSize;
+        src.buf = slot;
+      }
+
+      if(!sourceOpen)
+      {
+        if(open_source(&src, &jobs[sendJob], chunkSize) < 0)
+        {
+          status = OTP_SYSTEM_ERROR;
+          goto end;
+        }
+        sourceOpen = 1;
+      }
+
+      int result = next_frame(&src, &sendHdr, iov, mode, sendJob, chunkSize, &last);
+      if(result == OTP_SYSTEM_ERROR)
+      {
+        status = OTP_SYSTEM_ERROR;
+        goto end;
+      }
+      if(result == OTP_OK)
+      {
+        if(shm) { shm_frame(shm, slot, &sendHdr, iov, &sendOffset); }
+        iovAt = 0;
+        outstanding++;
+        sentFrames++;
+      }
+      else
+      {
+        /* Give up on this message alone, telling the server if part of it was already sent */
+        jobs[sendJob].status = result;
+        if(src.pos > 0)
+        {
+          abort_frame(&sendHdr, iov, mode, sendJob);
+          iovAt = 0;
+        }
+        last = 1;
+      }
+
+      if(last && iovAt == 3)
+      {
+        close_source(&src);
+        sourceOpen = 0;
+        last = 0;
+        sendJob++;
+        continue;
+      }
+    }
+
+    struct pollfd pfd = { .fd = sockDesc, .events = 0 };
+    if(iovAt < 3) { pfd.events |= POLLOUT; }
+    if(outstanding > 0) { pfd.events |= POLLIN; }
+    if(pfd.events == 0) { continue; }
+    if(poll(&pfd, 1, -1) < 0)
+    {
+      if(errno == EINTR) { continue; }
+      status = OTP_SYSTEM_ERROR;
+      goto end;
+    }
+
+    /* Results are checked first so a wrong server notice wins over a failed send */
+    if(pfd.revents & (POLLIN | POLLHUP | POLLERR))
+    {
+      ssize_t n;
+      if(hdrHave < sizeof(hdr)) { n = recv(sockDesc, (char *)&hdr + hdrHave, sizeof(hdr) - hdrHave, 0); }
+      else { n = recv(sockDesc, recvBuf, payloadLeft < chunkSize ? payloadLeft : chunkSize, 0); }
+      if(n == 0)
+      {
+        errno = ECONNRESET;
+        status = OTP_SYSTEM_ERROR;
+        goto end;
+      }
+      if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+        status = OTP_SYSTEM_ERROR;
+        goto end;
+      }
+
+      if(n > 0 && hdrHave < sizeof(hdr))
+      {
+        hdrHave += n;
+        if(hdrHave == sizeof(hdr))
+        {
+          /* Check for the frame type indicating we connected to the wrong server */
+          if(hdr.magic != OTP_MAGIC || hdr.type == OTP_WRONG)
+          {
+            status = OTP_WRONG_SERVER;
+            goto end;
+          }
+          recvJob = ntohl(hdr.id);
+          if(recvJob >= count || (hdr.type != OTP_RESULT && hdr.type != OTP_ERROR))
+          {
+            errno = EPROTO;
+            status = OTP_SYSTEM_ERROR;
+            goto end;
+          }
+          if(hdr.type == OTP_ERROR) { jobs[recvJob].status = OTP_REJECTED; }
+          payloadLeft = ntohl(hdr.length);
+
+          /* A result left in shared memory is written out straight from its slot */
+          if(hdr.flags & OTP_SHM)
+          {
+            if(!shm || payloadLeft > chunkSize)
+            {
+              errno = EPROTO;
+              status = OTP_SYSTEM_ERROR;
+              goto end;
+            }
+            char const *slot = shm->base + recvFrames % OTP_WINDOW * 2 * chunkSize;
+            if(hdr.type == OTP_RESULT && write_full(jobs[recvJob].outFD, slot, payloadLeft) < 0)
+            {
+              status = OTP_SYSTEM_ERROR;
+              goto end;
+            }
+            payloadLeft = 0;
+          }
+        }
+      }
+      else if(n > 0)
+      {
+        if(write_full(jobs[recvJob].outFD, recvBuf, n) < 0)
+        {
+          status = OTP_SYSTEM_ERROR;
+          goto end;
+        }
+        payloadLeft -= n;
+      }
+
+      /* A whole result has arrived, so another frame may be sent */
+      if(hdrHave == sizeof(hdr) && payloadLeft == 0)
+      {
+        hdrHave = 0;
+        outstanding--;
+        recvFrames++;
+
+        /* Finish the message with the newline its text was cut at */
+        if(!(hdr.flags & OTP_MORE))
+        {
+          if(jobs[recvJob].status == OTP_OK && write_full(jobs[recvJob].outFD, "\n", 1) < 0)
+          {
+            status = OTP_SYSTEM_ERROR;
+            goto end;
+          }
+          doneJobs = recvJob + 1;
+        }
+      }
+    }
+
+    if(iovAt < 3 && (pfd.revents & POLLOUT))
+    {
+      struct msghdr msg = { .msg_iov = iov + iovAt, .msg_iovlen = 3 - iovAt };
+      ssize_t n = sendmsg(sockDesc, &msg, MSG_NOSIGNAL);
+      if(n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      {
+        status = OTP_SYSTEM_ERROR;
+        goto end;
+      }
+
+      /* Step past whatever the kernel took, which may end partway through an iovec */
+      while(n > 0 && iovAt < 3)
+      {
+        size_t step = (size_t)n < iov[iovAt].iov_len ? (size_t)n : iov[iovAt].iov_len;
+        iov[iovAt].iov_base = (char *)iov[iovAt].iov_base + step;
+        iov[iovAt].iov_len -= step;
+        n -= step;
+        if(iov[iovAt].iov_len == 0) { iovAt++; }
+      }
+      while(iovAt < 3 && iov[iovAt].iov_len == 0) { iovAt++; }
+
+      /* With its last frame out the message's files are done with, on to the next one */
+      if(iovAt == 3 && last)
+      {
+        close_source(&src);
+        sourceOpen = 0;
+        last = 0;
+        sendJob++;
+      }
+      else if(iovAt == 3) { release_sent(&src); }
+    }
+  }
+
+end:
+  /* Messages the connection failed under share its fate, results already written stand */
+  if(status != OTP_OK)
+  {
+    for(size_t i = doneJobs; i < count; i++)
+    {
+      if(jobs[i].status == OTP_OK) { jobs[i].status = status; }
+    }
+  }
+  close_source(&src);
+  if(!shm) { free(src.buf); }
+  free(recvBuf);
+  return status;
+}
+
+
+int
+otp_client_stream(int sockDesc, int mode, int textFD, int keyFD, int outFD, size_t chunkSize,
+                  struct otp_shm const *shm)
+{
+  struct otp_job job;
+
+  job.textFD = textFD;
+  job.keyFD = keyFD;
+  job.keyOffset = 0;
+  job.outFD = outFD;
+  int status = otp_client_batch(sockDesc, mode, &job, 1, chunkSize, shm);
+  return status != OTP_OK ? status : job.status;
+}
+
+
+int
+otp_client_attach(int sockDesc, struct otp_shm *shm, size_t chunkSize)
+{
+  struct otp_header hdr;
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+
+  /* The whole region has to fit the 32 bit length of the frame handing it over */
+  if(chunkSize == 0 || chunkSize > OTP_MAX_PAYLOAD) { chunkSize = OTP_CHUNK_SIZE; }
+  if(chunkSize > UINT32_MAX / (2 * OTP_WINDOW)) { chunkSize = UINT32_MAX / (2 * OTP_WINDOW); }
+  size_t size = 2 * OTP_WINDOW * chunkSize;
+
+  /* Sealed so the server knows we cannot shrink it under its mapping */
+  int fd = memfd_create("otp_shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if(fd < 0) { return OTP_SYSTEM_ERROR; }
+  if(ftruncate(fd, size) < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL) < 0)
+  {
+    close(fd);
+    return OTP_SYSTEM_ERROR;
+  }
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(map == MAP_FAILED)
+  {
+    close(fd);
+    return OTP_SYSTEM_ERROR;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = OTP_MAGIC;
+  hdr.type = OTP_ATTACH;
+  hdr.length = htonl(size);
+
+  /* The descriptor rides along with the first byte of the frame */
+  struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                        .msg_controllen = sizeof(control.buf) };
+  struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+  cm->cmsg_level = SOL_SOCKET;
+  cm->cmsg_type = SCM_RIGHTS;
+  cm->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+
+  ssize_t n;
+  struct pollfd pfd = { .fd = sockDesc, .events = POLLOUT };
+  while((n = sendmsg(sockDesc, &msg, MSG_NOSIGNAL)) < 0 &&
+        (errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && poll(&pfd, 1, -1) >= 0))) {}
+  close(fd);
+  if(n < 0 || otp_sendall(sockDesc, (char *)&hdr + n, sizeof(hdr) - n, MSG_NOSIGNAL) < 0)
+  {
+    munmap(map, size);
+    return OTP_SYSTEM_ERROR;
+  }
+
+  shm->base = map;
+  shm->chunkSize = chunkSize;
+  return OTP_OK;
+}
+
+
+void
+otp_client_detach(struct otp_shm *shm)
+{
+  if(shm->base) { munmap(shm->base, 2 * OTP_WINDOW * shm->chunkSize); }
+  shm->base = NULL;
+}
@@ -0,0 +1,84 @@
+#ifndef OTP_CLIENT_H__
+#define OTP_CLIENT_H__
+
+/* This header provides the client side of the bulk protocol shared by
+ * enc_client and dec_client.
+ *
+ * The text and key are streamed to the server in fixed size chunks,
+ * each sent as its own frame, while the results of earlier chunks are
+ * read back and written out at the same time. Memory use is bounded by
+ * the chunk size no matter how large the files are, and each file is
+ * read exactly once with validation folded into that single pass.
+ *
+ * Many messages can share one connection. Their frames are pipelined
+ * back to back under one window, tagged with the message's index as
+ * request id, and each result is written to the output of the message
+ * it belongs to.
+ *
+ * Over a Unix domain socket the connection can attach a shared memory
+ * region instead. Each frame's text and key are then placed in a slot of
+ * the region, only the header and an offset cross the socket, and the
+ * server leaves the result in the slot for the client to write out.
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Default number of text characters sent per frame */
+#define OTP_CHUNK_SIZE 65536
+
+/* Most frames that may be waiting for their result at once */
+#define OTP_WINDOW 8
+
+/* Results of otp_client_stream() and of each otp_job, anything but OTP_OK means no further output follows */
+#define OTP_OK            0
+#define OTP_SYSTEM_ERROR -1   /* A read, write or socket call failed, errno is set */
+#define OTP_BAD_TEXT     -2   /* The text holds a character outside the alphabet */
+#define OTP_BAD_KEY      -3   /* The key holds a character outside the alphabet */
+#define OTP_SHORT_KEY    -4   /* The key ran out before the text did */
+#define OTP_WRONG_SERVER -5   /* The server does not serve this mode */
+#define OTP_REJECTED     -6   /* The server answered a frame with an error */
+
+/* Messages shorter than this are cheaper to send inline than to set up a region for */
+#define OTP_SHM_MIN (1 << 20)
+
+/* A shared memory region attached to one connection, with a slot per frame
+ * in the window each holding a text chunk followed by a key chunk */
+struct
+otp_shm {
+  char *base;
+  size_t chunkSize;   /* Characters per chunk, which replaces the chunk size of the calls below */
+};
+
+/* Create a region for chunks of chunkSize characters and pass it to the server
+ * over sockDesc, which must be a Unix domain socket. Returns OTP_OK or OTP_SYSTEM_ERROR */
+extern int otp_client_attach(int sockDesc, struct otp_shm *shm, size_t chunkSize);
+
+/* Unmap the region once the connection is done with it */
+extern void otp_client_detach(struct otp_shm *shm);
+
+/* Stream the text read from textFD up to its first newline, along with as much
+ * of keyFD, to the server in frames of mode (OTP_ENCRYPT or OTP_DECRYPT) of
+ * at most chunkSize characters, through shm when it is not NULL. The output is
+ * written to outFD as it arrives, followed by a newline. Returns one of the
+ * results above */
+extern int otp_client_stream(int sockDesc, int mode, int textFD, int keyFD, int outFD, size_t chunkSize,
+                             struct otp_shm const *shm);
+
+/* One message of a batch, read from textFD and keyFD and written to outFD */
+struct
+otp_job {
+  int textFD, keyFD, outFD;
+  off_t keyOffset;  /* Where the key starts in keyFD, such as a slice of a key pool, usually 0 */
+  int status;       /* Filled in with one of the results above */
+};
+
+/* Send every job over the same connection the way otp_client_stream() sends one,
+ * without waiting for a message's results before starting on the next. A job
+ * with bad input is given up on alone and the rest carry on. Returns OTP_OK once
+ * every job has its status, or the failure that cost the connection, in which
+ * case that is also the status of every job left unfinished */
+extern int otp_client_batch(int sockDesc, int mode, struct otp_job *jobs, size_t count, size_t chunkSize,
+                            struct otp_shm const *shm);
+
+#endif  //OTP_CLIENT_H__
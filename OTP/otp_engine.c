@@ -0,0 +1,1248 @@
+#define _GNU_SOURCE  // accept4(), F_GET_SEALS
+
+#include <endian.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "otp_cipher.h"
+#include "otp_engine.h"
+#include "otp_metrics.h"
+#include "otp_pool.h"
+#include "otp_proto.h"
+
+/* Number of events handled per call to epoll_wait() */
+#define MAX_EVENTS 256
+
+/* Bytes of room made in the input buffer before each recv() */
+#define READ_CHUNK 65536
+
+/* Buffers larger than this are given back once they drain so idle connections stay small */
+#define KEEP_BUFFER (1 << 20)
+
+/* Size of a legacy protocol message: two characters and an identifier */
+#define LEGACY_SIZE 3
+
+/* Once this much output is waiting on a client, its input is left unread until
+ * the client catches up, so a client that sends without reading cannot grow it further */
+#define OUTPUT_LIMIT (4 << 20)
+
+/* Deadlines are kept in a timer wheel of one second slots. Connections whose
+ * deadline is further out than the wheel spans go round more than once */
+#define WHEEL_SLOTS 64
+
+/* A connection only earns more time by receiving this much, by completing a
+ * message or by its output moving, so trickling a byte at a time does not keep it alive */
+#define PROGRESS_BYTES READ_CHUNK
+
+/* Seconds a worker told to stop waits for its connections to finish */
+#define DRAIN_SECONDS 10
+
+/* Microseconds before a worker that died is replaced, or a failed fork tried again */
+#define RESTART_DELAY 1000000
+
+/* Frames at least this long are worked on by the worker's thread pool, smaller
+ * ones by the event loop alone, which is quicker than waking the pool for them */
+#define PARALLEL_MIN (4 << 20)
+
+/* Characters each pool thread validates or transforms at a time. A large frame's
+ * result is produced and queued one round of a piece per thread at a time */
+#define PARALLEL_PIECE (1 << 20)
+
+/* Per connection state. Bytes waiting to be parsed live in in[inStart, inStart+inLen)
+ * and bytes waiting to be sent live in out[outStart, outStart+outLen) */
+struct conn {
+  int fd;
+  int closing;   /* Stop parsing, and hang up once the output drains */
+  int inMessage; /* Part of a message has been answered and the rest is still to come */
+  int streaming; /* The result header of the large frame at the front of the input is queued */
+  size_t frameDone;  /* Characters of that frame transformed and queued so far */
+  size_t discard;    /* Bytes of a frame too large to take still to be dropped as they arrive */
+  uint32_t events; /* Events currently requested from epoll */
+  struct sockaddr_in peer;
+  char *in;
+  size_t inStart, inLen, inCap;
+  char *out;
+  size_t outStart, outLen, outCap;
+  uint64_t frameStart;   /* When the header of the frame being received was parsed, 0 between frames */
+  uint64_t deadline;     /* Tick at which the connection is dropped unless it makes progress */
+  size_t quietBytes;     /* Bytes received since the deadline last moved */
+  size_t slot;           /* Wheel slot the connection is linked into */
+  struct conn *wheelPrev, *wheelNext;
+  int passedFD;          /* Last descriptor the client passed us and OTP_ATTACH has not taken, or -1 */
+  char *shm;             /* Region the client attached, NULL without one */
+  size_t shmSize;
+};
+
+/* Each worker runs a single threaded event loop, so its settings are file scoped */
+static int epollFD = -1;
+static int listenFD = -1;
+static int unixFD = -1;      /* Listening Unix socket shared by every worker, -1 without one */
+static int serverModes;      /* OTP_SERVE_ flags of the frame types accepted */
+static int maxConnections;   /* 0 for no limit */
+static int liveConnections;
+static int accepting;        /* The listening sockets are in the epoll set */
+static struct otp_metrics *metrics;       /* This worker's slot of the shared counters */
+static struct otp_metrics localMetrics;   /* Used when running without a supervisor */
+static struct otp_pool *pool;             /* Threads shared by every connection's large frames */
+static struct conn *wheel[WHEEL_SLOTS];   /* Every connection, by the slot of its deadline */
+static uint64_t tick;                     /* Seconds since the worker started */
+static uint64_t idleTicks;                /* Seconds a connection may go without progress, 0 for no limit */
+static int timerFD = -1;                  /* Fires once a second to advance the wheel */
+static int stopFD = -1;                   /* Delivers SIGTERM and SIGINT */
+static int draining;                      /* Told to stop, finishing the connections already open */
+static uint64_t drainDeadline;
+
+/* epoll data of the timer, the signals and the Unix listener, told apart from connections by address */
+static char timerEvent, stopEvent, unixEvent;
+
+
+/**
+ * Make sure there are at least need free bytes after the data held in a
+ * buffer, sliding the data to the front first and growing if that is not
+ * enough. Returns -1 if memory runs out
+ */
+static int
+reserve(char **buf, size_t *start, size_t len, size_t *cap, size_t need)
+{
+  if(*cap - *start - len >= need) { return 0; }
+  if(*start > 0)
+  {
+    memmove(*buf, *buf + *start, len);
+    *start = 0;
+    if(*cap - len >= need) { return 0; }
+  }
+
+  size_t newCap = *cap ? *cap * 2 : READ_CHUNK;
+  while(newCap - len < need) { newCap *= 2; }
+  char *grown = realloc(*buf, newCap);
+  if(grown == NULL) { return -1; }
+  *buf = grown;
+  *cap = newCap;
+  return 0;
+}
+
+
+/**
+ * Start or stop taking new connections from the listening sockets. Every
+ * worker waits on the same Unix socket, so it is added with EPOLLEXCLUSIVE
+ * to wake one of them per connection, and since such an entry cannot be
+ * modified the sockets are added and removed instead
+ */
+static void
+set_accepting(int on)
+{
+  struct epoll_event ev;
+
+  if(draining) { on = 0; }
+  if(accepting == on) { return; }
+  ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+  ev.data.ptr = NULL;
+  if(epoll_ctl(epollFD, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, listenFD, &ev) < 0) { err(1, "epoll_ctl"); }
+  ev.data.ptr = &unixEvent;
+  if(unixFD >= 0 && epoll_ctl(epollFD, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, unixFD, &ev) < 0) { err(1, "epoll_ctl"); }
+  accepting = on;
+}
+
+
+/* Link a connection into the wheel slot of its deadline */
+static void
+wheel_insert(struct conn *c)
+{
+  c->slot = c->deadline % WHEEL_SLOTS;
+  c->wheelPrev = NULL;
+  c->wheelNext = wheel[c->slot];
+  if(c->wheelNext) { c->wheelNext->wheelPrev = c; }
+  wheel[c->slot] = c;
+}
+
+
+static void
+wheel_remove(struct conn *c)
+{
+  if(c->wheelPrev) { c->wheelPrev->wheelNext = c->wheelNext; }
+  else { wheel[c->slot] = c->wheelNext; }
+  if(c->wheelNext) { c->wheelNext->wheelPrev = c->wheelPrev; }
+}
+
+
+/* Push the deadline back after the connection made progress. The connection
+ * stays in its slot and only moves once that slot comes round, so this is cheap
+ * enough to call on every message */
+static void
+conn_touch(struct conn *c)
+{
+  c->deadline = idleTicks ? tick + idleTicks : UINT64_MAX;
+  c->quietBytes = 0;
+}
+
+
+/* Close the socket, which also drops it from the epoll set, and free everything */
+static void
+conn_close(struct conn *c)
+{
+  wheel_remove(c);
+  close(c->fd);
+  if(c->passedFD >= 0) { close(c->passedFD); }
+  if(c->shm) { munmap(c->shm, c->shmSize); }
+  free(c->in);
+  free(c->out);
+  free(c);
+
+  /* A slot opened up, so go back to accepting if we were full */
+  liveConnections--;
+  otp_metric_set(&metrics->active, liveConnections);
+  if(maxConnections > 0 && liveConnections < maxConnections) { set_accepting(1); }
+}
+
+
+/**
+ * Ask epoll for room to write while output is waiting, and for input unless
+ * so much output is waiting that the client has to read some first. A closing
+ * connection keeps reading to swallow what the client is still sending
+ */
+static int
+conn_set_events(struct conn *c)
+{
+  struct epoll_event ev;
+
+  ev.events = 0;
+  if(c->closing || c->outLen < OUTPUT_LIMIT) { ev.events |= EPOLLIN; }
+  if(c->outLen > 0) { ev.events |= EPOLLOUT; }
+  if(ev.events == c->events) { return 0; }
+  ev.data.ptr = c;
+  if(epoll_ctl(epollFD, EPOLL_CTL_MOD, c->fd, &ev) < 0) { return -1; }
+  c->events = ev.events;
+  return 0;
+}
+
+
+/* Append a frame header to the output buffer, room must already be reserved */
+static void
+put_header(struct conn *c, int type, int flags, int status, uint32_t id, uint32_t len)
+{
+  struct otp_header hdr;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = OTP_MAGIC;
+  hdr.type = type;
+  hdr.flags = flags;
+  hdr.status = status;
+  hdr.id = htonl(id);
+  hdr.length = htonl(len);
+  memcpy(c->out + c->outStart + c->outLen, &hdr, sizeof(hdr));
+  c->outLen += sizeof(hdr);
+}
+
+
+/* Queue a frame without payload, used for the wrong server and error notices */
+static int
+queue_notice(struct conn *c, int type, uint32_t id)
+{
+  if(reserve(&c->out, &c->outStart, c->outLen, &c->outCap, sizeof(struct otp_header)) < 0) { return -1; }
+  put_header(c, type, 0, 0, id, 0);
+  return 0;
+}
+
+
+/* Turns len characters of text and key into len characters of output.
+ * Returns -1 if either input holds a character outside the alphabet */
+typedef int (*otp_transform_fn)(char *out, char const *text, char const *key, size_t len);
+
+
+/* Pick the cipher for a request's mode, NULL if this server does not serve it */
+static otp_transform_fn
+transform_for(int mode)
+{
+  if(mode == OTP_ENCRYPT && (serverModes & OTP_SERVE_ENCRYPT)) { return otp_encrypt; }
+  if(mode == OTP_DECRYPT && (serverModes & OTP_SERVE_DECRYPT)) { return otp_decrypt; }
+  return NULL;
+}
+
+
+/**
+ * Handle a single legacy message of two characters and an identifier,
+ * replying exactly the way the old fork per connection server did
+ */
+static int
+process_legacy(struct conn *c, char const *msg)
+{
+  char reply[LEGACY_SIZE];
+  otp_transform_fn transform = transform_for(msg[2]);
+
+  if(reserve(&c->out, &c->outStart, c->outLen, &c->outCap, LEGACY_SIZE) < 0) { return -1; }
+
+  /* Check the identifier index to make sure we are dealing with the right client */
+  if(transform == NULL && msg[2] != 'a')
+  {
+    fprintf(stderr, "Wrong client connected. Attempted port: %d\n", ntohs(c->peer.sin_port));
+    otp_metric_add(&metrics->wrongClient, 1);
+    reply[0] = msg[0];
+    reply[1] = msg[1];
+    reply[2] = 'w';
+    c->closing = 1;
+  }
+  /* The end of the text gets the termination identifier and ends the conversation */
+  else if(msg[0] == '@' && msg[1] == '@' && transform)
+  {
+    reply[0] = '@';
+    reply[1] = '@';
+    reply[2] = 't';
+    c->closing = 1;
+    c->inMessage = 0;
+  }
+  /* Otherwise transform the pair, a bad character is answered with an identifier the client ignores */
+  else if(msg[0] != '@' && msg[1] != '@' && transform)
+  {
+    reply[1] = '\0';
+    reply[2] = transform(&reply[0], &msg[0], &msg[1], 1) < 0 ? OTP_ERROR : 'c';
+    c->inMessage = 1;
+  }
+  else { return 0; }
+
+  memcpy(c->out + c->outStart + c->outLen, reply, LEGACY_SIZE);
+  c->outLen += LEGACY_SIZE;
+  otp_metric_add(&metrics->legacy, 1);
+  conn_touch(c);
+  return 0;
+}
+
+
+/**
+ * Map the region the client passed ahead of an OTP_ATTACH frame of size
+ * bytes, replacing any it attached before. The memfd must be sealed
+ * against shrinking, or the client could truncate it under us and fault
+ * the worker. Returns -1 if the client passed nothing usable
+ */
+static int
+conn_attach(struct conn *c, uint32_t size)
+{
+  struct stat st;
+  int fd = c->passedFD;
+
+  c->passedFD = -1;
+  if(fd < 0) { return -1; }
+  int seals = fcntl(fd, F_GET_SEALS);
+  if(size == 0 || seals < 0 || !(seals & F_SEAL_SHRINK) || fstat(fd, &st) < 0 || st.st_size < size)
+  {
+    close(fd);
+    return -1;
+  }
+  char *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) { return -1; }
+
+  if(c->shm) { munmap(c->shm, c->shmSize); }
+  c->shm = map;
+  c->shmSize = size;
+  return 0;
+}
+
+
+/* Find the text block of an OTP_SHM frame in the attached region, NULL unless
+ * both of its blocks lie inside it */
+static char *
+shm_blocks(struct conn const *c, char const *payload, uint32_t len)
+{
+  uint64_t offset;
+
+  memcpy(&offset, payload, sizeof(offset));
+  offset = be64toh(offset);
+  if(c->shm == NULL || offset > c->shmSize || 2 * (uint64_t)len > c->shmSize - offset) { return NULL; }
+  return c->shm + offset;
+}
+
+
+/* A large frame split into pieces for the pool */
+struct split {
+  otp_transform_fn transform;
+  char *out;
+  char const *text, *key;
+  size_t len;
+  int failed;       /* Set by any piece that met a character outside the alphabet */
+};
+
+
+static void
+check_piece(void *arg, size_t index)
+{
+  struct split *sp = arg;
+  size_t at = index * PARALLEL_PIECE;
+  size_t len = sp->len - at < PARALLEL_PIECE ? sp->len - at : PARALLEL_PIECE;
+
+  if(otp_check(sp->text + at, len) < len || otp_check(sp->key + at, len) < len)
+  {
+    __atomic_store_n(&sp->failed, 1, __ATOMIC_RELAXED);
+  }
+}
+
+
+static void
+transform_piece(void *arg, size_t index)
+{
+  struct split *sp = arg;
+  size_t at = index * PARALLEL_PIECE;
+  size_t len = sp->len - at < PARALLEL_PIECE ? sp->len - at : PARALLEL_PIECE;
+
+  if(sp->transform(sp->out + at, sp->text + at, sp->key + at, len) < 0)
+  {
+    __atomic_store_n(&sp->failed, 1, __ATOMIC_RELAXED);
+  }
+}
+
+
+/* Run fn over len characters a piece per item on the pool, returning -1 if any piece failed */
+static int
+run_split(void (*fn)(void *, size_t), otp_transform_fn transform, char *out, char const *text,
+          char const *key, size_t len)
+{
+  struct split sp = { .transform = transform, .out = out, .text = text, .key = key, .len = len, .failed = 0 };
+
+  otp_pool_run(pool, fn, &sp, (len + PARALLEL_PIECE - 1) / PARALLEL_PIECE);
+  return sp.failed ? -1 : 0;
+}
+
+
+/**
+ * Answer a large frame that has fully arrived, validating all of it on the
+ * pool first so an error can still take the place of the result, and then
+ * transforming it into the output a round at a time. Stops between rounds
+ * once the output limit is reached, and picks up from there on the next
+ * call, so the result streams out in order as the client reads it. Returns
+ * 1 while the frame is unfinished, 0 once it is answered and -1 if memory runs out
+ */
+static int
+stream_frame(struct conn *c, struct otp_header const *hdr, otp_transform_fn transform)
+{
+  char const *text = c->in + c->inStart + sizeof(*hdr);
+  char const *key = text + hdr->length;
+
+  if(!c->streaming)
+  {
+    if(reserve(&c->out, &c->outStart, c->outLen, &c->outCap, sizeof(*hdr)) < 0) { return -1; }
+    if(run_split(check_piece, transform, NULL, text, key, hdr->length) < 0)
+    {
+      fprintf(stderr, "Bad character in frame from port %d\n", ntohs(c->peer.sin_port));
+      put_header(c, OTP_ERROR, hdr->flags, 0, hdr->id, 0);
+      otp_metric_add(&metrics->rejected, 1);
+      return 0;
+    }
+    put_header(c, OTP_RESULT, hdr->flags, 0, hdr->id, hdr->length);
+    c->streaming = 1;
+    c->frameDone = 0;
+  }
+
+  size_t round = (size_t)otp_pool_threads(pool) * PARALLEL_PIECE;
+  while(c->frameDone < hdr->length && c->outLen < OUTPUT_LIMIT)
+  {
+    size_t len = hdr->length - c->frameDone < round ? hdr->length - c->frameDone : round;
+    if(reserve(&c->out, &c->outStart, c->outLen, &c->outCap, len) < 0) { return -1; }
+    run_split(transform_piece, transform, c->out + c->outStart + c->outLen, text + c->frameDone,
+              key + c->frameDone, len);
+    c->outLen += len;
+    c->frameDone += len;
+  }
+  if(c->frameDone < hdr->length) { return 1; }
+  c->streaming = 0;
+  return 0;
+}
+
+
+/**
+ * Parse as many complete messages as the input buffer holds and queue
+ * their replies. Returns -1 if memory runs out
+ */
+static int
+conn_process(struct conn *c)
+{
+  /* Past the output limit the rest waits until the client has read some of its results */
+  while(!c->closing && c->inLen > 0 && c->outLen < OUTPUT_LIMIT)
+  {
+    /* The rest of a frame too large to take, already answered */
+    if(c->discard > 0)
+    {
+      size_t n = c->inLen < c->discard ? c->inLen : c->discard;
+      c->inStart += n;
+      c->inLen -= n;
+      c->discard -= n;
+      continue;
+    }
+
+    char *msg = c->in + c->inStart;
+
+    /* Anything not starting with the magic byte is the legacy protocol */
+    if(msg[0] != OTP_MAGIC)
+    {
+      if(c->inLen < LEGACY_SIZE) { break; }
+      if(process_legacy(c, msg) < 0) { return -1; }
+      c->inStart += LEGACY_SIZE;
+      c->inLen -= LEGACY_SIZE;
+      continue;
+    }
+
+    struct otp_header hdr;
+    if(c->inLen < sizeof(hdr)) { break; }
+    memcpy(&hdr, msg, sizeof(hdr));
+    hdr.id = ntohl(hdr.id);
+    hdr.length = ntohl(hdr.length);
+
+    /* The client found a bad character partway through and gave up on a message. Every
+     * frame stands on its own so there is nothing to drop, and later messages carry on */
+    if(hdr.type == OTP_ERROR)
+    {
+      otp_metric_add(&metrics->aborted, 1);
+      c->inMessage = 0;
+      c->inStart += sizeof(hdr);
+      c->inLen -= sizeof(hdr);
+      continue;
+    }
+
+    /* A shared memory region to take the blocks of later frames from */
+    if(hdr.type == OTP_ATTACH)
+    {
+      if(conn_attach(c, hdr.length) < 0)
+      {
+        fprintf(stderr, "Bad shared memory region from port %d\n", ntohs(c->peer.sin_port));
+        otp_metric_add(&metrics->rejected, 1);
+        c->closing = 1;
+        return queue_notice(c, OTP_ERROR, hdr.id);
+      }
+      c->inStart += sizeof(hdr);
+      c->inLen -= sizeof(hdr);
+      continue;
+    }
+
+    /* Each frame names its own mode, check that it is one this server serves */
+    otp_transform_fn transform = transform_for(hdr.type);
+    if(transform == NULL)
+    {
+      fprintf(stderr, "Wrong client connected. Attempted port: %d\n", ntohs(c->peer.sin_port));
+      otp_metric_add(&metrics->wrongClient, 1);
+      c->closing = 1;
+      return queue_notice(c, OTP_WRONG, hdr.id);
+    }
+    int shared = (hdr.flags & OTP_SHM) != 0;
+    size_t frameSize = sizeof(hdr) + (shared ? sizeof(uint64_t) : 2 * (size_t)hdr.length);
+
+    /* A frame over the limit is answered with an error straight away, and its payload
+     * dropped as it arrives rather than held, so the frames after it still get through */
+    if(hdr.length > OTP_MAX_PAYLOAD)
+    {
+      fprintf(stderr, "Frame of %u bytes from port %d is too large\n", hdr.length, ntohs(c->peer.sin_port));
+      otp_metric_add(&metrics->rejected, 1);
+      if(reserve(&c->out, &c->outStart, c->outLen, &c->outCap, sizeof(hdr)) < 0) { return -1; }
+      put_header(c, OTP_ERROR, hdr.flags, OTP_TOO_LARGE, hdr.id, 0);
+      c->inStart += sizeof(hdr);
+      c->inLen -= sizeof(hdr);
+      c->discard = frameSize - sizeof(hdr);
+      c->inMessage = (hdr.flags & OTP_MORE) != 0;
+      continue;
+    }
+
+    /* Wait for the whole frame, which the key block coming after all of the text makes
+     * necessary. The buffer only grows as its bytes arrive, so a header alone costs nothing,
+     * and OTP_MAX_PAYLOAD bounds how far. A frame whose blocks are in shared memory only
+     * carries their offset */
+    if(c->frameStart == 0) { c->frameStart = otp_metrics_now(); }
+    if(c->inLen < frameSize) { break; }
+
+    /* A large frame sent inline is streamed back a round at a time, whenever the pool
+     * is worth waking for it and whenever its result would not fit under the output
+     * limit, which a single pass into the output buffer would blow through */
+    int parallel = hdr.length >= PARALLEL_MIN && otp_pool_threads(pool) > 1;
+    if(!shared && (parallel || sizeof(hdr) + hdr.length > OUTPUT_LIMIT))
+    {
+      int streamed = stream_frame(c, &hdr, transform);
+      if(streamed < 0) { return -1; }
+      if(streamed > 0) { break; }
+    }
+    /* Otherwise transform straight from the input buffer into the output buffer after
+     * the reply header, or in place in shared memory so only the header goes back */
+    else
+    {
+      size_t replyLen = shared ? 0 : hdr.length;
+      if(reserve(&c->out, &c->outStart, c->outLen, &c->outCap, sizeof(hdr) + replyLen) < 0) { return -1; }
+      char *text = shared ? shm_blocks(c, msg + sizeof(hdr), hdr.length) : msg + sizeof(hdr);
+      char *result = shared ? text : c->out + c->outStart + c->outLen + sizeof(hdr);
+      int failed = text == NULL;
+      if(!failed && parallel) { failed = run_split(transform_piece, transform, result, text, text + hdr.length, hdr.length); }
+      else if(!failed) { failed = transform(result, text, text + hdr.length, hdr.length); }
+      if(failed)
+      {
+        fprintf(stderr, "Bad %s in frame from port %d\n", text ? "character" : "offset", ntohs(c->peer.sin_port));
+        put_header(c, OTP_ERROR, hdr.flags, 0, hdr.id, 0);
+        otp_metric_add(&metrics->rejected, 1);
+      }
+      else
+      {
+        put_header(c, OTP_RESULT, hdr.flags, 0, hdr.id, hdr.length);
+        c->outLen += replyLen;
+      }
+    }
+    c->inStart += frameSize;
+    c->inLen -= frameSize;
+    otp_metric_add(&metrics->requests, 1);
+    otp_metrics_latency(metrics, otp_metrics_now() - c->frameStart);
+    c->frameStart = 0;
+    c->inMessage = (hdr.flags & OTP_MORE) != 0;
+    conn_touch(c);
+  }
+
+  /* Give back large buffers once a big message has been consumed */
+  if(c->inLen == 0)
+  {
+    c->inStart = 0;
+    if(c->inCap > KEEP_BUFFER)
+    {
+      free(c->in);
+      c->in = NULL;
+      c->inCap = 0;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * Send as much queued output as the socket takes, asking for EPOLLOUT if
+ * some is left over and for EPOLLIN again once it is under the limit.
+ * Returns -1 if the connection should be closed
+ */
+static int
+conn_flush(struct conn *c)
+{
+  while(c->outLen > 0)
+  {
+    ssize_t n = send(c->fd, c->out + c->outStart, c->outLen, MSG_NOSIGNAL);
+    if(n < 0)
+    {
+      if(errno == EINTR) { continue; }
+      if(errno == EAGAIN || errno == EWOULDBLOCK) { return conn_set_events(c); }
+      return -1;
+    }
+    c->outStart += n;
+    c->outLen -= n;
+    otp_metric_add(&metrics->bytesOut, n);
+    conn_touch(c);
+  }
+
+  c->outStart = 0;
+  if(c->outCap > KEEP_BUFFER)
+  {
+    free(c->out);
+    c->out = NULL;
+    c->outCap = 0;
+  }
+  /* Hang up our side but keep reading until the client closes, so the data it
+   * is still sending does not make the kernel reset the connection under our reply */
+  if(c->closing) { shutdown(c->fd, SHUT_WR); }
+  return conn_set_events(c);
+}
+
+
+/**
+ * Send what the client has room for, then pick up any input that was left
+ * waiting while the output was over the limit. Returns -1 if the connection
+ * should be closed
+ */
+static int
+conn_writable(struct conn *c)
+{
+  for(;;)
+  {
+    if(conn_flush(c) < 0) { return -1; }
+    if(c->closing || c->inLen == 0 || c->outLen >= OUTPUT_LIMIT) { return 0; }
+
+    /* Stop once only part of a message is left */
+    size_t before = c->inLen, beforeDone = c->frameDone;
+    if(conn_process(c) < 0) { return -1; }
+    if(c->inLen == before && c->frameDone == beforeDone) { return 0; }
+  }
+}
+
+
+/* Keep the last descriptor passed along with the data just received for
+ * OTP_ATTACH to take, closing any others */
+static void
+take_passed(struct conn *c, struct msghdr *msg)
+{
+  for(struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm))
+  {
+    if(cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) { continue; }
+    int const *fds = (int const *)CMSG_DATA(cm);
+    for(size_t i = 0; i < (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int); i++)
+    {
+      if(c->passedFD >= 0) { close(c->passedFD); }
+      c->passedFD = fds[i];
+    }
+  }
+}
+
+
+/**
+ * Read whatever the client has sent, process every complete message
+ * and start sending the replies. Returns -1 if the connection should be closed
+ */
+static int
+conn_readable(struct conn *c)
+{
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(4 * sizeof(int))];
+  } control;
+
+  for(;;)
+  {
+    if(reserve(&c->in, &c->inStart, c->inLen, &c->inCap, READ_CHUNK) < 0) { return -1; }
+    size_t room = c->inCap - c->inStart - c->inLen;
+    struct iovec iov = { .iov_base = c->in + c->inStart + c->inLen, .iov_len = room };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control.buf,
+                          .msg_controllen = sizeof(control.buf) };
+    ssize_t n = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+    if(n >= 0 && msg.msg_controllen > 0) { take_passed(c, &msg); }
+    if(n < 0)
+    {
+      if(errno == EINTR) { continue; }
+      if(errno == EAGAIN || errno == EWOULDBLOCK) { break; }
+      return -1;
+    }
+    /* The client hung up, nothing more will be asked of us */
+    if(n == 0) { return -1; }
+    c->inLen += n;
+    otp_metric_add(&metrics->bytesIn, n);
+    c->quietBytes += n;
+    if(c->quietBytes >= PROGRESS_BYTES) { conn_touch(c); }
+    /* A closing connection only swallows whatever the client is still sending */
+    if(c->closing) { c->inLen = 0; }
+    else if(conn_process(c) < 0) { return -1; }
+    if((size_t)n < room || (!c->closing && c->outLen >= OUTPUT_LIMIT)) { break; }
+  }
+
+  return conn_writable(c);
+}
+
+
+/* Accept every pending connection on a listening socket and add it to the epoll
+ * set, leaving the rest queued in the backlog once this worker holds its maximum */
+static void
+accept_all(int fd)
+{
+  for(;;)
+  {
+    if(maxConnections > 0 && liveConnections >= maxConnections)
+    {
+      set_accepting(0);
+      return;
+    }
+
+    /* Unix socket peers have no port and are reported as port 0 */
+    struct sockaddr_in peer;
+    socklen_t peerLen = sizeof(peer);
+    memset(&peer, 0, sizeof(peer));
+    int connFD = accept4(fd, fd == listenFD ? (struct sockaddr *)&peer : NULL, fd == listenFD ? &peerLen : NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(connFD < 0)
+    {
+      if(errno == EINTR || errno == ECONNABORTED) { continue; }
+      if(errno != EAGAIN && errno != EWOULDBLOCK) { warn("accept"); }
+      return;
+    }
+
+    struct conn *c = calloc(1, sizeof(*c));
+    if(c == NULL)
+    {
+      warnx("out of memory for connection");
+      close(connFD);
+      continue;
+    }
+    c->fd = connFD;
+    c->passedFD = -1;
+    c->peer = peer;
+    c->events = EPOLLIN;
+    conn_touch(c);
+    wheel_insert(c);
+    liveConnections++;
+    otp_metric_add(&metrics->accepted, 1);
+    otp_metric_set(&metrics->active, liveConnections);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if(epoll_ctl(epollFD, EPOLL_CTL_ADD, connFD, &ev) < 0)
+    {
+      warn("epoll_ctl");
+      conn_close(c);
+    }
+  }
+}
+
+
+/* Whether a connection is between messages with nothing left to send */
+static int
+conn_idle(struct conn const *c)
+{
+  return c->inLen == 0 && c->outLen == 0 && !c->inMessage && c->discard == 0;
+}
+
+
+/**
+ * Advance the wheel by one second, dropping every connection in the slot
+ * that came round whose deadline has passed and moving the others to the
+ * slot of their current deadline. While draining, idle connections are
+ * dropped too
+ */
+static void
+wheel_tick(void)
+{
+  tick++;
+  struct conn *c = wheel[tick % WHEEL_SLOTS];
+  wheel[tick % WHEEL_SLOTS] = NULL;
+
+  while(c != NULL)
+  {
+    struct conn *next = c->wheelNext;
+    wheel_insert(c);
+    if(c->deadline <= tick)
+    {
+      fprintf(stderr, "Connection from port %d timed out\n", ntohs(c->peer.sin_port));
+      otp_metric_add(&metrics->timedOut, 1);
+      conn_close(c);
+    }
+    c = next;
+  }
+}
+
+
+/* Stop accepting and drop every connection that is not in the middle of something */
+static void
+start_draining(void)
+{
+  draining = 1;
+  drainDeadline = tick + DRAIN_SECONDS;
+  set_accepting(0);
+
+  for(int i = 0; i < WHEEL_SLOTS; i++)
+  {
+    struct conn *c = wheel[i];
+    while(c != NULL)
+    {
+      struct conn *next = c->wheelNext;
+      if(conn_idle(c)) { conn_close(c); }
+      c = next;
+    }
+  }
+}
+
+
+int
+otp_engine_run(int listenSocket, int unixSocket, struct otp_engine_options const *opts)
+{
+  struct epoll_event events[MAX_EVENTS];
+  struct rlimit limit;
+
+  listenFD = listenSocket;
+  unixFD = unixSocket;
+  maxConnections = opts->maxConnections;
+  serverModes = opts->modes;
+  idleTicks = opts->idleTimeout > 0 ? opts->idleTimeout : 0;
+  if(metrics == NULL) { metrics = &localMetrics; }
+
+  /* Thousands of clients need thousands of descriptors, so take all we are allowed */
+  if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+  {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  int flags = fcntl(listenSocket, F_GETFL);
+  if(flags < 0 || fcntl(listenSocket, F_SETFL, flags | O_NONBLOCK) < 0) { return -1; }
+  if(unixSocket >= 0)
+  {
+    flags = fcntl(unixSocket, F_GETFL);
+    if(flags < 0 || fcntl(unixSocket, F_SETFL, flags | O_NONBLOCK) < 0) { return -1; }
+  }
+
+  epollFD = epoll_create1(EPOLL_CLOEXEC);
+  if(epollFD < 0) { return -1; }
+
+  /* The TCP listening socket is the only entry without a connection attached,
+   * the Unix one is told apart by address like the timer and the signals */
+  set_accepting(1);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+
+  /* A one second timer drives the deadlines */
+  struct itimerspec second = { .it_interval = { 1, 0 }, .it_value = { 1, 0 } };
+  timerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if(timerFD < 0 || timerfd_settime(timerFD, 0, &second, NULL) < 0) { return -1; }
+  ev.data.ptr = &timerEvent;
+  if(epoll_ctl(epollFD, EPOLL_CTL_ADD, timerFD, &ev) < 0) { return -1; }
+
+  /* Being told to stop drains the open connections instead of cutting them off */
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  if(sigprocmask(SIG_BLOCK, &mask, NULL) < 0) { return -1; }
+  if((stopFD = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) { return -1; }
+  ev.data.ptr = &stopEvent;
+  if(epoll_ctl(epollFD, EPOLL_CTL_ADD, stopFD, &ev) < 0) { return -1; }
+
+  /* Started after the signals are blocked so that none of its threads takes them */
+  if((pool = otp_pool_create(opts->threads)) == NULL) { return -1; }
+
+  while(!draining || (liveConnections > 0 && tick < drainDeadline))
+  {
+    int n = epoll_wait(epollFD, events, MAX_EVENTS, -1);
+    if(n < 0)
+    {
+      if(errno == EINTR) { continue; }
+      err(1, "epoll_wait");
+    }
+
+    /* The timer and the signals are handled after the connections, since they
+     * may close connections that still have events later in this batch */
+    uint64_t ticks = 0;
+    int stop = 0;
+    for(int i = 0; i < n; i++)
+    {
+      struct conn *c = events[i].data.ptr;
+      if(c == NULL)
+      {
+        accept_all(listenFD);
+        continue;
+      }
+      if(events[i].data.ptr == &unixEvent)
+      {
+        accept_all(unixFD);
+        continue;
+      }
+      if(events[i].data.ptr == &timerEvent)
+      {
+        uint64_t expired;
+        if(read(timerFD, &expired, sizeof(expired)) == sizeof(expired)) { ticks += expired; }
+        continue;
+      }
+      if(events[i].data.ptr == &stopEvent)
+      {
+        struct signalfd_siginfo info;
+        while(read(stopFD, &info, sizeof(info)) > 0) { stop = 1; }
+        continue;
+      }
+
+      int failed = 0;
+      if(events[i].events & EPOLLIN) { failed = conn_readable(c); }
+      else if(events[i].events & (EPOLLERR | EPOLLHUP)) { failed = -1; }
+      if(!failed && (events[i].events & EPOLLOUT)) { failed = conn_writable(c); }
+      if(!failed && draining && conn_idle(c)) { failed = -1; }
+      if(failed) { conn_close(c); }
+    }
+
+    while(ticks-- > 0) { wheel_tick(); }
+    if(stop && !draining) { start_draining(); }
+  }
+  otp_pool_destroy(pool);
+  pool = NULL;
+  return 0;
+}
+
+
+/**
+ * Create a listening socket on the port that shares it with the other
+ * workers through SO_REUSEPORT, so the kernel spreads new connections
+ * across all of them. Returns -1 on failure
+ */
+static int
+open_listener(int port, int backlog)
+{
+  struct sockaddr_in address;
+  int on = 1;
+
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(fd < 0) { return -1; }
+  if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+     setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  /* Allow a client at any address to connect to this server */
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = INADDR_ANY;
+
+  if(bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, backlog) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+/* State of the supervising process, which forks the workers and reports their metrics */
+static struct otp_metrics *workerMetrics;   /* One slot per worker, shared with all of them */
+static sigset_t workerMask;                 /* Signal mask to restore in each worker */
+static int signalFD = -1;                   /* Delivers SIGCHLD when a worker dies */
+static int adminFD = -1;                    /* Listening admin socket, -1 without one */
+static int clientUnixFD = -1;               /* Unix socket for clients on this machine, -1 without one */
+
+
+/* Fork a worker that serves its own listening socket until the parent goes away */
+static pid_t
+spawn_worker(int *sockets, int count, int index, struct otp_engine_options const *opts)
+{
+  pid_t pid = fork();
+  if(pid != 0) { return pid; }
+
+  /* Workers die with the server rather than outliving it */
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if(getppid() == 1) { _exit(0); }
+
+  for(int i = 0; i < count; i++)
+  {
+    if(i != index) { close(sockets[i]); }
+  }
+  close(signalFD);
+  if(adminFD >= 0) { close(adminFD); }
+  sigprocmask(SIG_SETMASK, &workerMask, NULL);
+
+  /* A replacement worker carries on the counters of the one it replaces */
+  metrics = &workerMetrics[index];
+  otp_metric_set(&metrics->active, 0);
+  if(otp_engine_run(sockets[index], clientUnixFD, opts) < 0)
+  {
+    err(1, "worker %d", index);
+  }
+  _exit(0);
+}
+
+
+/* Listen on a Unix socket at path, replacing a stale one. Returns -1 on failure */
+static int
+open_unix(char const *path, int backlog)
+{
+  struct sockaddr_un address;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(address.sun_path))
+  {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(address.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(fd < 0) { return -1; }
+  unlink(path);
+  if(bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, backlog) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+/* Answer one admin connection with the report and hang up */
+static void
+send_report(int workers)
+{
+  char *text = NULL;
+  size_t len = 0;
+
+  int fd = accept4(adminFD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if(fd < 0) { return; }
+  FILE *out = open_memstream(&text, &len);
+  if(out != NULL)
+  {
+    otp_metrics_report(out, workerMetrics, workers);
+    fclose(out);
+    otp_sendall(fd, text, len, MSG_NOSIGNAL);
+    free(text);
+  }
+  close(fd);
+}
+
+
+int
+otp_engine_serve(struct otp_engine_options const *opts)
+{
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if(cores <= 0) { cores = 1; }
+  int workers = opts->workers > 0 ? opts->workers : cores;
+
+  /* Unless told otherwise the workers split the cores between their pools, so that
+   * large frames arriving at every worker at once do not oversubscribe the machine */
+  struct otp_engine_options workerOpts = *opts;
+  if(workerOpts.threads <= 0) { workerOpts.threads = cores / workers > 0 ? cores / workers : 1; }
+
+  /* SO_REUSEPORT would quietly let us join another server already on the port,
+   * so first make sure a bind of the port without it succeeds. SO_REUSEADDR still
+   * refuses a live listener but lets connections left in TIME_WAIT by the last
+   * run of the server through, as the listeners themselves do */
+  struct sockaddr_in address;
+  int on = 1;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(opts->port);
+  address.sin_addr.s_addr = INADDR_ANY;
+  int probe = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if(probe < 0) { return -1; }
+  if(setsockopt(probe, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+     bind(probe, (struct sockaddr *)&address, sizeof(address)) < 0)
+  {
+    close(probe);
+    return -1;
+  }
+  close(probe);
+
+  /* Every socket is bound before any worker starts so a busy port is reported right away */
+  int *sockets = calloc(workers, sizeof(*sockets));
+  pid_t *pids = calloc(workers, sizeof(*pids));
+  if(sockets == NULL || pids == NULL) { return -1; }
+  for(int i = 0; i < workers; i++)
+  {
+    if((sockets[i] = open_listener(opts->port, opts->backlog)) < 0) { return -1; }
+  }
+  if(opts->adminPath && (adminFD = open_unix(opts->adminPath, 16)) < 0) { return -1; }
+  if(opts->unixPath && (clientUnixFD = open_unix(opts->unixPath, opts->backlog)) < 0) { return -1; }
+
+  /* Workers write their metrics straight into memory the parent can read */
+  workerMetrics = mmap(NULL, workers * sizeof(*workerMetrics), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(workerMetrics == MAP_FAILED) { return -1; }
+
+  /* Worker deaths and requests to stop arrive through a signalfd, so they share
+   * one poll loop with admin requests and the report timer. The signals are
+   * blocked before the first fork so none can slip through */
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigaddset(&mask, SIGTERM);
+  sigaddset(&mask, SIGINT);
+  if(sigprocmask(SIG_BLOCK, &mask, &workerMask) < 0) { return -1; }
+  if((signalFD = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) { return -1; }
+
+  for(int i = 0; i < workers; i++)
+  {
+    if((pids[i] = spawn_worker(sockets, workers, i, &workerOpts)) < 0) { return -1; }
+  }
+
+  /* The parent keeps every socket open and replaces any worker that dies, so
+   * connections the kernel queued for it are served by its replacement. A slot
+   * whose worker is gone holds pid 0 until its restart is due, RESTART_DELAY
+   * later so a worker that keeps crashing cannot spin the parent. Once told to
+   * stop it passes that on and returns when the last worker has drained */
+  uint64_t *restartAt = calloc(workers, sizeof(*restartAt));
+  if(restartAt == NULL) { return -1; }
+  int running = workers, stopping = 0;
+  uint64_t interval = (uint64_t)opts->statsInterval * 1000000;
+  uint64_t nextReport = otp_metrics_now() + interval;
+  for(;;)
+  {
+    struct pollfd pfds[2] = { { .fd = signalFD, .events = POLLIN }, { .fd = adminFD, .events = POLLIN } };
+    uint64_t now = otp_metrics_now(), wake = interval > 0 ? nextReport : UINT64_MAX;
+    for(int i = 0; i < workers && !stopping; i++)
+    {
+      if(pids[i] == 0 && restartAt[i] < wake) { wake = restartAt[i]; }
+    }
+    int timeout = -1;
+    if(wake != UINT64_MAX) { timeout = wake > now ? (wake - now + 999) / 1000 : 0; }
+    if(poll(pfds, 2, timeout) < 0)
+    {
+      if(errno == EINTR) { continue; }
+      return -1;
+    }
+
+    if(pfds[0].revents & POLLIN)
+    {
+      struct signalfd_siginfo info;
+      while(read(signalFD, &info, sizeof(info)) > 0)
+      {
+        if(info.ssi_signo == SIGCHLD || stopping) { continue; }
+        stopping = 1;
+        for(int i = 0; i < workers; i++)
+        {
+          if(pids[i] > 0) { kill(pids[i], SIGTERM); }
+        }
+      }
+
+      int status;
+      pid_t pid;
+      while((pid = waitpid(-1, &status, WNOHANG)) > 0)
+      {
+        for(int i = 0; i < workers; i++)
+        {
+          if(pids[i] != pid) { continue; }
+          pids[i] = 0;
+          running--;
+          if(stopping) { continue; }
+          warnx("worker %d exited with status %d, restarting it", i, status);
+          restartAt[i] = otp_metrics_now() + RESTART_DELAY;
+        }
+      }
+      if(stopping && running == 0) { break; }
+    }
+
+    /* A fork that fails leaves the slot empty to be tried again later */
+    for(int i = 0; i < workers && !stopping; i++)
+    {
+      if(pids[i] != 0 || otp_metrics_now() < restartAt[i]) { continue; }
+      if((pids[i] = spawn_worker(sockets, workers, i, &workerOpts)) > 0)
+      {
+        running++;
+        continue;
+      }
+      warn("restarting worker %d", i);
+      pids[i] = 0;
+      restartAt[i] = otp_metrics_now() + RESTART_DELAY;
+    }
+    if(pfds[1].revents & POLLIN) { send_report(workers); }
+    if(interval > 0 && otp_metrics_now() >= nextReport)
+    {
+      otp_metrics_report(stderr, workerMetrics, workers);
+      nextReport += interval;
+    }
+  }
+
+  if(adminFD >= 0)
+  {
+    close(adminFD);
+    unlink(opts->adminPath);
+  }
+  if(clientUnixFD >= 0)
+  {
+    close(clientUnixFD);
+    unlink(opts->unixPath);
+  }
+  for(int i = 0; i < workers; i++) { close(sockets[i]); }
+  munmap(workerMetrics, workers * sizeof(*workerMetrics));
+  close(signalFD);
+  free(sockets);
+  free(pids);
+  free(restartAt);
+  return 0;
+}
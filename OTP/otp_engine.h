@@ -0,0 +1,86 @@
+#ifndef OTP_ENGINE_H__
+#define OTP_ENGINE_H__
+
+/* This header provides the event driven server core shared by
+ * enc_server, dec_server and otp_server.
+ *
+ * Each worker process multiplexes all of its connections with epoll.
+ * Each connection is a small state machine with its own partial read
+ * and partial write buffers, so a slow client never blocks the others
+ * and there is no limit on concurrent clients besides file descriptors.
+ * Both the bulk frame protocol and the legacy three byte protocol are
+ * understood. Bulk connections stay open across messages, and
+ * pipelined frames are answered in the order they arrive.
+ *
+ * otp_engine_serve() pre-forks a number of worker processes, each with
+ * its own listening socket bound to the same port with SO_REUSEPORT and
+ * its own event loop, so the kernel load balances connections across
+ * cores without any process being created per connection. Each worker
+ * keeps its counters and latency histogram in memory shared with the
+ * supervising process, which reports them on an admin socket or on a
+ * timer without ever stopping a worker.
+ *
+ * Every connection has a deadline, kept in a timer wheel, that only moves
+ * when it makes real progress, so clients that stall or trickle bytes
+ * are dropped instead of holding their slot. A client that sends more
+ * than it reads has its input left unread once enough output is waiting
+ * for it, which pushes back on the client through TCP.
+ *
+ * Every request names its own mode, so one server can serve encryption
+ * and decryption from the same port and worker pool. A server limited
+ * to one mode answers requests for the other with a wrong server notice.
+ *
+ * Clients on the same machine can also connect over a Unix domain socket
+ * that every worker accepts from, skipping the TCP loopback path, and
+ * there attach a shared memory region so the text, key and result of
+ * each frame are never copied through the socket at all.
+ *
+ * Each worker also keeps a pool of threads shared by all of its
+ * connections, the workers splitting the cores between them. A large
+ * frame is validated and transformed on the whole pool, its result
+ * queued a round at a time so it streams back in order while later
+ * rounds are worked on, and small frames skip the pool. A frame carries
+ * at most OTP_MAX_PAYLOAD, 64 MiB, of text. One over that is answered
+ * with an OTP_ERROR of status OTP_TOO_LARGE, and its payload is dropped
+ * as it arrives while the connection carries on.
+ */
+
+#include <stddef.h>
+
+/* Seconds a connection may go without progress unless told otherwise */
+#define OTP_IDLE_TIMEOUT 30
+
+/* Modes a server accepts requests for */
+#define OTP_SERVE_ENCRYPT 0x01
+#define OTP_SERVE_DECRYPT 0x02
+#define OTP_SERVE_BOTH    (OTP_SERVE_ENCRYPT | OTP_SERVE_DECRYPT)
+
+struct
+otp_engine_options {
+  int port;
+  int modes;            /* OTP_SERVE_ flags of the requests served */
+  int workers;          /* Worker processes, 0 for one per online core */
+  int backlog;          /* listen() backlog of each worker's socket */
+  int maxConnections;   /* Connections held by each worker at once, 0 for no limit */
+  char const *adminPath;  /* Unix socket answering each connection with a metrics report, NULL for none */
+  char const *unixPath;   /* Unix socket clients may connect to besides the port, NULL for none */
+  int statsInterval;    /* Seconds between metrics reports on stderr, 0 for none */
+  int idleTimeout;      /* Seconds a connection may go without progress, 0 for no limit */
+  int threads;          /* Threads of each worker's pool for large frames, 0 for its share of the online cores */
+};
+
+/* Serve clients accepted from listenSocket, and from unixSocket unless it is -1,
+ * in the calling process with the settings in opts, of which the port, workers,
+ * backlog and socket paths are left to otp_engine_serve(). Requests for modes
+ * outside opts->modes are answered with a wrong server notice. Runs until
+ * SIGTERM or SIGINT, then stops accepting and returns 0 once the open
+ * connections finish or a grace period runs out. Returns -1 if the event loop
+ * cannot be set up */
+extern int otp_engine_run(int listenSocket, int unixSocket, struct otp_engine_options const *opts);
+
+/* Bind the port once per worker, start the workers and supervise them until
+ * SIGTERM or SIGINT, which is passed on to the workers. Returns 0 once they have
+ * all drained, -1 if the sockets or workers cannot be set up */
+extern int otp_engine_serve(struct otp_engine_options const *opts);
+
+#endif  //OTP_ENGINE_H__
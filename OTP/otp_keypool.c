@@ -0,0 +1,167 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "otp_keypool.h"
+
+/* First bytes of every pool, the last one counting versions of the layout */
+#define KEYPOOL_MAGIC "OTPPOOL1"
+
+/* Laid out at the start of the header page in host byte order, since a pool is
+ * only ever mapped on the machine it is used on */
+struct pool_header {
+  char magic[8];
+  uint64_t capacity;              /* Key characters after the header page */
+  _Atomic uint64_t reserved;      /* Characters handed out so far, only ever advanced */
+};
+
+struct
+otp_keypool {
+  int fd;
+  int writable;                   /* Opened for reserving, not just for looking slices up */
+  char *map;                      /* The header page and every key character */
+  size_t mapSize;
+  struct pool_header *hdr;
+};
+
+
+int
+otp_keypool_format(int fd, uint64_t capacity)
+{
+  char page[OTP_KEYPOOL_HEADER];
+  struct pool_header *hdr = (struct pool_header *)page;
+
+  memset(page, 0, sizeof(page));
+  memcpy(hdr->magic, KEYPOOL_MAGIC, sizeof(hdr->magic));
+  hdr->capacity = capacity;
+  atomic_init(&hdr->reserved, 0);
+
+  for(size_t done = 0; done < sizeof(page);)
+  {
+    ssize_t n = write(fd, page + done, sizeof(page) - done);
+    if(n < 0)
+    {
+      if(errno == EINTR) { continue; }
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+
+struct otp_keypool *
+otp_keypool_open(char const *path)
+{
+  struct stat st;
+
+  /* A copy kept only for decrypting may well be read only */
+  int writable = 1;
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if(fd < 0 && (errno == EACCES || errno == EROFS))
+  {
+    writable = 0;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+  }
+  if(fd < 0) { return NULL; }
+  if(fstat(fd, &st) < 0 || (size_t)st.st_size < OTP_KEYPOOL_HEADER)
+  {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+
+  /* Shared, so reservations made through it are seen by every other process mapping the pool */
+  char *map = mmap(NULL, st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+  struct otp_keypool *pool = malloc(sizeof(*pool));
+  if(map == MAP_FAILED || pool == NULL)
+  {
+    if(map != MAP_FAILED) { munmap(map, st.st_size); }
+    free(pool);
+    close(fd);
+    return NULL;
+  }
+  pool->fd = fd;
+  pool->writable = writable;
+  pool->map = map;
+  pool->mapSize = st.st_size;
+  pool->hdr = (struct pool_header *)map;
+
+  /* A pool cut short would hand out characters it does not have */
+  if(memcmp(pool->hdr->magic, KEYPOOL_MAGIC, sizeof(pool->hdr->magic)) != 0 ||
+     pool->hdr->capacity > (uint64_t)st.st_size - OTP_KEYPOOL_HEADER)
+  {
+    otp_keypool_close(pool);
+    errno = EINVAL;
+    return NULL;
+  }
+  return pool;
+}
+
+
+int
+otp_keypool_fd(struct otp_keypool const *pool)
+{
+  return pool->fd;
+}
+
+
+int
+otp_keypool_reserve(struct otp_keypool *pool, size_t len, uint64_t *offset)
+{
+  uint64_t capacity = pool->hdr->capacity;
+  uint64_t at = atomic_load(&pool->hdr->reserved);
+
+  if(!pool->writable)
+  {
+    errno = EROFS;
+    return -1;
+  }
+  /* Only advanced when the whole message fits, so a reservation that fails costs nothing */
+  do
+  {
+    if(len > capacity - at)
+    {
+      errno = ENOSPC;
+      return -1;
+    }
+  } while(!atomic_compare_exchange_weak(&pool->hdr->reserved, &at, at + len));
+
+  /* A reservation lost in a crash would let the same characters be handed out
+   * again, which is the one thing a one time pad cannot survive */
+  if(msync(pool->map, OTP_KEYPOOL_HEADER, MS_SYNC) < 0) { return -1; }
+  *offset = at;
+  return 0;
+}
+
+
+char const *
+otp_keypool_keys(struct otp_keypool const *pool, uint64_t offset, size_t len)
+{
+  uint64_t capacity = pool->hdr->capacity;
+
+  if(offset > capacity || len > capacity - offset) { return NULL; }
+  return pool->map + OTP_KEYPOOL_HEADER + offset;
+}
+
+
+uint64_t
+otp_keypool_remaining(struct otp_keypool const *pool)
+{
+  return pool->hdr->capacity - atomic_load(&pool->hdr->reserved);
+}
+
+
+void
+otp_keypool_close(struct otp_keypool *pool)
+{
+  munmap(pool->map, pool->mapSize);
+  close(pool->fd);
+  free(pool);
+}
@@ -0,0 +1,53 @@
+#ifndef OTP_KEYPOOL_H__
+#define OTP_KEYPOOL_H__
+
+/* This header provides key pools, files of key material generated ahead
+ * of time that messages take their keys from instead of a key file each.
+ *
+ * A pool is a page of header followed by the key characters, and is
+ * shared by every process that maps it. The header holds how many
+ * characters have been handed out so far, which only ever grows and is
+ * advanced atomically, so each character is handed to exactly one
+ * message even with many clients reserving at once. A message only needs
+ * its offset into the pool, and its key is sent straight out of the
+ * mapping.
+ *
+ * The pool is meant to be copied to whoever decrypts before any of it
+ * is used. Decrypting looks a slice up by offset without reserving it.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Bytes in front of the key characters, a page so that they start page aligned */
+#define OTP_KEYPOOL_HEADER 4096
+
+struct otp_keypool;
+
+/* Write the header of a pool of capacity characters to fd, where the characters
+ * themselves must follow. Returns -1 on failure, 0 on success */
+extern int otp_keypool_format(int fd, uint64_t capacity);
+
+/* Map the pool at path, read only if that is all it allows. NULL if it cannot
+ * be opened or is not a complete pool */
+extern struct otp_keypool *otp_keypool_open(char const *path);
+
+/* Descriptor of the pool file, where the key character at offset sits at OTP_KEYPOOL_HEADER + offset */
+extern int otp_keypool_fd(struct otp_keypool const *pool);
+
+/* Reserve the next len characters for one message, setting *offset to where they
+ * start. The reservation reaches the file before this returns, so no crash can
+ * hand the same characters out twice. Returns -1 with errno ENOSPC if fewer than
+ * len are left or EROFS if the pool could only be opened read only, 0 on success */
+extern int otp_keypool_reserve(struct otp_keypool *pool, size_t len, uint64_t *offset);
+
+/* The len characters at offset in place, NULL if the pool does not hold them all */
+extern char const *otp_keypool_keys(struct otp_keypool const *pool, uint64_t offset, size_t len);
+
+/* Characters not reserved yet */
+extern uint64_t otp_keypool_remaining(struct otp_keypool const *pool);
+
+/* Unmap the pool */
+extern void otp_keypool_close(struct otp_keypool *pool);
+
+#endif  //OTP_KEYPOOL_H__
@@ -0,0 +1,310 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "otp_cipher.h"
+#include "otp_local.h"
+#include "otp_proto.h"
+
+
+/* One thread's share of the characters being transformed */
+struct piece {
+  int mode;
+  char *out;
+  char const *text, *key;
+  size_t len;        /* Characters of text */
+  size_t keyLen;     /* Characters of key there are for them, at most len */
+  size_t textStop;   /* Set to the first character of text outside the alphabet, len if none */
+  size_t keyStop;    /* Set to the same for the key, looking no further than the good text */
+  int result;        /* Set to what the cipher returned */
+};
+
+
+/* Threads to use for len characters when asked for threads, 0 meaning pick */
+static int
+threads_for(size_t len, int threads)
+{
+  if(threads > 0) { return threads; }
+  if(len < OTP_LOCAL_THREADED) { return 1; }
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? cores : 1;
+}
+
+
+/* Split len characters into at most threads pieces of at least a chunk each, returning how many */
+static size_t
+split(size_t len, int threads, size_t *pieceLen)
+{
+  size_t count = (len + OTP_LOCAL_CHUNK - 1) / OTP_LOCAL_CHUNK;
+  if(count > (size_t)threads) { count = threads; }
+  if(count == 0) { count = 1; }
+  *pieceLen = (len + count - 1) / count;
+  return count;
+}
+
+
+/* Run fn on every piece, each on a thread of its own unless there is just one.
+ * A piece whose thread cannot be started is done on the calling thread */
+static void
+run_pieces(void *(*fn)(void *), struct piece *pieces, size_t count)
+{
+  if(count == 1)
+  {
+    fn(&pieces[0]);
+    return;
+  }
+
+  pthread_t *tids = calloc(count, sizeof(*tids));
+  char *started = calloc(count, 1);
+  for(size_t i = 0; i < count; i++)
+  {
+    if(tids && started && pthread_create(&tids[i], NULL, fn, &pieces[i]) == 0) { started[i] = 1; }
+    else { fn(&pieces[i]); }
+  }
+  for(size_t i = 0; i < count; i++)
+  {
+    if(started && started[i]) { pthread_join(tids[i], NULL); }
+  }
+  free(started);
+  free(tids);
+}
+
+
+static void *
+transform_piece(void *arg)
+{
+  struct piece *p = arg;
+
+  p->result = p->mode == OTP_DECRYPT ? otp_decrypt(p->out, p->text, p->key, p->len)
+                                     : otp_encrypt(p->out, p->text, p->key, p->len);
+  return NULL;
+}
+
+
+int
+otp_transform(int mode, char *out, char const *text, char const *key, size_t len, int threads)
+{
+  size_t pieceLen;
+  size_t count = split(len, threads_for(len, threads), &pieceLen);
+
+  struct piece *pieces = calloc(count, sizeof(*pieces));
+  if(pieces == NULL)
+  {
+    return mode == OTP_DECRYPT ? otp_decrypt(out, text, key, len) : otp_encrypt(out, text, key, len);
+  }
+  for(size_t i = 0, at = 0; i < count; i++, at += pieceLen)
+  {
+    pieces[i].mode = mode;
+    pieces[i].out = out + at;
+    pieces[i].text = text + at;
+    pieces[i].key = key + at;
+    pieces[i].len = len - at < pieceLen ? len - at : pieceLen;
+  }
+  run_pieces(transform_piece, pieces, count);
+
+  int result = 0;
+  for(size_t i = 0; i < count; i++)
+  {
+    if(pieces[i].result < 0) { result = -1; }
+  }
+  free(pieces);
+  return result;
+}
+
+
+/* Validate a piece of a message and transform as much of it as is good. Where
+ * exactly the message ends or goes bad is sorted out in order afterwards */
+static void *
+check_piece(void *arg)
+{
+  struct piece *p = arg;
+
+  p->textStop = otp_check(p->text, p->len);
+  size_t keyLen = p->keyLen < p->textStop ? p->keyLen : p->textStop;
+  p->keyStop = otp_check(p->key, keyLen);
+  size_t good = p->textStop < p->keyStop ? p->textStop : p->keyStop;
+  p->result = p->mode == OTP_DECRYPT ? otp_decrypt(p->out, p->text, p->key, good)
+                                     : otp_encrypt(p->out, p->text, p->key, good);
+  return NULL;
+}
+
+
+/* Read until len bytes arrive or the file ends, returning how many arrived or -1 */
+static ssize_t
+read_full(int fd, char *buf, size_t len)
+{
+  size_t total = 0;
+
+  while(total < len)
+  {
+    ssize_t n = read(fd, buf + total, len - total);
+    if(n < 0)
+    {
+      if(errno == EINTR) { continue; }
+      return -1;
+    }
+    if(n == 0) { break; }
+    total += n;
+  }
+  return total;
+}
+
+
+/* Write all len bytes, returning -1 on failure */
+static int
+write_full(int fd, char const *buf, size_t len)
+{
+  while(len > 0)
+  {
+    ssize_t n = write(fd, buf, len);
+    if(n < 0)
+    {
+      if(errno == EINTR) { continue; }
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+
+/* Map a whole regular file read only, NULL if it is empty or cannot be mapped */
+static char const *
+map_file(int fd, size_t *size)
+{
+  struct stat st;
+
+  if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) { return NULL; }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(map == MAP_FAILED) { return NULL; }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  *size = st.st_size;
+  return map;
+}
+
+
+int
+otp_local_stream(int mode, int textFD, int keyFD, int outFD, int threads)
+{
+  size_t textSize = 0, keySize = 0;
+  char const *textMap = map_file(textFD, &textSize);
+  char const *keyMap = map_file(keyFD, &keySize);
+  int status = OTP_OK, last = 0;
+
+  /* Each round hands every thread a chunk, files that cannot be mapped are read a round at a time */
+  threads = threads_for(textSize, threads);
+  size_t round = (size_t)threads * OTP_LOCAL_CHUNK;
+  char *outBuf = textMap ? malloc(textSize < round ? textSize : round) : NULL;
+  char *textBuf = textMap ? NULL : malloc(round);
+  char *keyBuf = keyMap ? NULL : malloc(round);
+  struct piece *pieces = calloc(threads, sizeof(*pieces));
+  if((textMap && !outBuf) || (!textMap && !textBuf) || (!keyMap && !keyBuf) || !pieces)
+  {
+    status = OTP_SYSTEM_ERROR;
+    goto end;
+  }
+
+  for(size_t pos = 0; !last; pos += round)
+  {
+    char const *text, *key;
+    size_t textLen, keyLen;
+
+    if(textMap)
+    {
+      text = textMap + pos;
+      textLen = textSize - pos < round ? textSize - pos : round;
+      if(pos + textLen == textSize) { last = 1; }
+    }
+    else
+    {
+      ssize_t n = read_full(textFD, textBuf, round);
+      if(n < 0)
+      {
+        status = OTP_SYSTEM_ERROR;
+        goto end;
+      }
+      text = textBuf;
+      textLen = n;
+      if(textLen < round) { last = 1; }
+    }
+    if(keyMap)
+    {
+      key = keyMap + pos;
+      keyLen = pos < keySize ? keySize - pos : 0;
+      if(keyLen > textLen) { keyLen = textLen; }
+    }
+    else
+    {
+      ssize_t n = read_full(keyFD, keyBuf, textLen);
+      if(n < 0)
+      {
+        status = OTP_SYSTEM_ERROR;
+        goto end;
+      }
+      key = keyBuf;
+      keyLen = n;
+    }
+
+    /* Text read into a buffer is transformed in place */
+    char *out = textMap ? outBuf : textBuf;
+    size_t pieceLen;
+    size_t count = split(textLen, threads, &pieceLen);
+    for(size_t i = 0, at = 0; i < count; i++, at += pieceLen)
+    {
+      pieces[i].mode = mode;
+      pieces[i].out = out + at;
+      pieces[i].text = text + at;
+      pieces[i].key = key + at;
+      pieces[i].len = textLen - at < pieceLen ? textLen - at : pieceLen;
+      pieces[i].keyLen = keyLen <= at ? 0 : keyLen - at < pieces[i].len ? keyLen - at : pieces[i].len;
+    }
+    run_pieces(check_piece, pieces, count);
+
+    /* The message ends at the first newline in its text, and anything else
+     * outside the alphabet before that in the text or the key is an error */
+    size_t outLen = 0;
+    for(size_t i = 0; i < count; i++)
+    {
+      struct piece const *p = &pieces[i];
+      size_t good = p->len;
+      if(p->textStop < p->len)
+      {
+        if(p->text[p->textStop] != '\n')
+        {
+          status = OTP_BAD_TEXT;
+          goto end;
+        }
+        good = p->textStop;
+        last = 1;
+      }
+      if(p->keyStop < good)
+      {
+        status = p->keyStop < p->keyLen && p->key[p->keyStop] != '\n' ? OTP_BAD_KEY : OTP_SHORT_KEY;
+        goto end;
+      }
+      outLen += good;
+      if(good < p->len) { break; }
+    }
+    if(write_full(outFD, out, outLen) < 0)
+    {
+      status = OTP_SYSTEM_ERROR;
+      goto end;
+    }
+  }
+  if(write_full(outFD, "\n", 1) < 0) { status = OTP_SYSTEM_ERROR; }
+
+end:
+  if(textMap) { munmap((void *)textMap, textSize); }
+  if(keyMap) { munmap((void *)keyMap, keySize); }
+  free(outBuf);
+  free(textBuf);
+  free(keyBuf);
+  free(pieces);
+  return status;
+}
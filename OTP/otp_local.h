@@ -0,0 +1,37 @@
+#ifndef OTP_LOCAL_H__
+#define OTP_LOCAL_H__
+
+/* This header provides the OTP cipher in process, for programs that
+ * have the text and key on hand and no reason to go through a server.
+ *
+ * Large inputs are split into chunks that are validated and transformed
+ * on several threads at once, since every character is independent of
+ * the others. Files are handled the same way the clients handle them,
+ * so the output matches what enc_client and dec_client would print.
+ *
+ * Together with the cipher, the client and the protocol this makes up
+ * libotp.a.
+ */
+
+#include <stddef.h>
+
+#include "otp_client.h"
+
+/* Characters each thread works through at a time */
+#define OTP_LOCAL_CHUNK (1 << 20)
+
+/* Inputs at least this long use every core when no thread count is given */
+#define OTP_LOCAL_THREADED (16 * OTP_LOCAL_CHUNK)
+
+/* Encrypt or decrypt (mode OTP_ENCRYPT or OTP_DECRYPT) len characters of text
+ * with key into out, which may be the same buffer as text, using up to threads
+ * threads or as many as suit len when it is 0. Returns -1 if either input holds
+ * a character outside the alphabet */
+extern int otp_transform(int mode, char *out, char const *text, char const *key, size_t len, int threads);
+
+/* Transform the text read from textFD up to its first newline, along with as
+ * much of keyFD, and write the output to outFD followed by a newline, the way
+ * otp_client_stream() does through a server. Returns one of the OTP_ results */
+extern int otp_local_stream(int mode, int textFD, int keyFD, int outFD, int threads);
+
+#endif  //OTP_LOCAL_H__
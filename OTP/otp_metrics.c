@@ -0,0 +1,94 @@
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include "otp_metrics.h"
+
+
+uint64_t
+otp_metrics_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+void
+otp_metrics_latency(struct otp_metrics *m, uint64_t micros)
+{
+  /* The bucket is the bit length of the duration */
+  int bucket = micros ? 64 - __builtin_clzll(micros) : 0;
+  if(bucket >= OTP_METRICS_BUCKETS) { bucket = OTP_METRICS_BUCKETS - 1; }
+  otp_metric_add(&m->latency[bucket], 1);
+}
+
+
+/* Take a consistent enough copy of a worker's slot, every field read once */
+static void
+snapshot(struct otp_metrics *to, struct otp_metrics const *from)
+{
+  uint64_t const *src = (uint64_t const *)from;
+  uint64_t *dst = (uint64_t *)to;
+
+  memset(to, 0, sizeof(*to));
+  for(size_t i = 0; i < offsetof(struct otp_metrics, latency) / sizeof(uint64_t) + OTP_METRICS_BUCKETS; i++)
+  {
+    dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+  }
+}
+
+
+/* Upper bound in microseconds of the bucket holding the p quantile, 0 with no requests */
+static uint64_t
+percentile(uint64_t const *latency, double p)
+{
+  uint64_t total = 0, seen = 0;
+
+  for(int i = 0; i < OTP_METRICS_BUCKETS; i++) { total += latency[i]; }
+  if(total == 0) { return 0; }
+  for(int i = 0; i < OTP_METRICS_BUCKETS; i++)
+  {
+    seen += latency[i];
+    if(seen >= p * total) { return (uint64_t)1 << i; }
+  }
+  return (uint64_t)1 << (OTP_METRICS_BUCKETS - 1);
+}
+
+
+static void
+report_row(FILE *out, char const *name, struct otp_metrics const *m)
+{
+  fprintf(out, "%-7s %7lu %9lu %10lu %8lu %13lu %13lu %6lu %8lu %7lu %8lu %8lu %8lu %8lu\n", name,
+          m->active, m->accepted, m->requests, m->legacy, m->bytesIn, m->bytesOut,
+          m->wrongClient, m->rejected, m->aborted, m->timedOut,
+          percentile(m->latency, 0.50), percentile(m->latency, 0.99), percentile(m->latency, 0.999));
+}
+
+
+void
+otp_metrics_report(FILE *out, struct otp_metrics const *workers, int count)
+{
+  struct otp_metrics total, one;
+  char name[16];
+
+  memset(&total, 0, sizeof(total));
+  fprintf(out, "%-7s %7s %9s %10s %8s %13s %13s %6s %8s %7s %8s %8s %8s %8s\n", "worker",
+          "active", "accepted", "requests", "legacy", "bytes_in", "bytes_out",
+          "wrong", "rejected", "aborted", "timeouts", "p50_us", "p99_us", "p999_us");
+  for(int i = 0; i < count; i++)
+  {
+    snapshot(&one, &workers[i]);
+    snprintf(name, sizeof(name), "%d", i);
+    report_row(out, name, &one);
+
+    uint64_t *sum = (uint64_t *)&total;
+    uint64_t const *add = (uint64_t const *)&one;
+    for(size_t j = 0; j < offsetof(struct otp_metrics, latency) / sizeof(uint64_t) + OTP_METRICS_BUCKETS; j++)
+    {
+      sum[j] += add[j];
+    }
+  }
+  report_row(out, "total", &total);
+}
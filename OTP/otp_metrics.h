@@ -0,0 +1,58 @@
+#ifndef OTP_METRICS_H__
+#define OTP_METRICS_H__
+
+/* This header provides the counters and latency histograms kept by
+ * every server worker.
+ *
+ * Each worker owns one struct otp_metrics and is the only one writing
+ * it, so updates are plain relaxed stores with no locks or atomic
+ * read-modify-write instructions. The slots of all workers live in one
+ * shared mapping, each on its own cache lines, where the supervising
+ * process reads them to print a report.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Latency bucket i counts requests that took under 2^i microseconds
+ * and at least 2^(i-1), the last one everything slower */
+#define OTP_METRICS_BUCKETS 32
+
+struct
+otp_metrics {
+  uint64_t active;        /* Connections open right now */
+  uint64_t accepted;      /* Connections accepted */
+  uint64_t requests;      /* Bulk frames answered */
+  uint64_t legacy;        /* Legacy three byte messages answered */
+  uint64_t bytesIn;       /* Bytes received from clients */
+  uint64_t bytesOut;      /* Bytes sent to clients */
+  uint64_t wrongClient;   /* Requests for a mode this server does not serve */
+  uint64_t rejected;      /* Frames answered with an error */
+  uint64_t aborted;       /* Messages abandoned partway through by their client */
+  uint64_t timedOut;      /* Connections dropped for making no progress */
+  uint64_t latency[OTP_METRICS_BUCKETS];  /* Bulk frames by time from header to queued result */
+} __attribute__((aligned(64)));
+
+/* Only the owning worker calls these, readers may run in another process at any time */
+static inline void
+otp_metric_add(uint64_t *counter, uint64_t n)
+{
+  __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline void
+otp_metric_set(uint64_t *gauge, uint64_t value)
+{
+  __atomic_store_n(gauge, value, __ATOMIC_RELAXED);
+}
+
+/* Microseconds on the monotonic clock */
+extern uint64_t otp_metrics_now(void);
+
+/* Count one request that took the given number of microseconds */
+extern void otp_metrics_latency(struct otp_metrics *m, uint64_t micros);
+
+/* Write a table with a row per worker and a total row to out */
+extern void otp_metrics_report(FILE *out, struct otp_metrics const *workers, int count);
+
+#endif  //OTP_METRICS_H__
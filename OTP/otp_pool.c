@@ -0,0 +1,130 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "otp_pool.h"
+
+struct
+otp_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;        /* Signalled when a run starts or the pool stops */
+  pthread_cond_t done;        /* Signalled when the last item of a run finishes */
+  void (*fn)(void *arg, size_t index);
+  void *arg;
+  size_t count;               /* Items in the current run */
+  size_t next;                /* Next item to hand out */
+  size_t finished;            /* Items done */
+  int stop;
+  int threads;                /* Counting the caller of otp_pool_run() */
+  pthread_t *tids;
+};
+
+
+/* Take items until the run is handed out, with the lock held on entry and exit */
+static void
+work_through(struct otp_pool *pool)
+{
+  while(pool->next < pool->count)
+  {
+    size_t index = pool->next++;
+    pthread_mutex_unlock(&pool->lock);
+    pool->fn(pool->arg, index);
+    pthread_mutex_lock(&pool->lock);
+    if(++pool->finished == pool->count) { pthread_cond_signal(&pool->done); }
+  }
+}
+
+
+static void *
+pool_thread(void *arg)
+{
+  struct otp_pool *pool = arg;
+
+  pthread_mutex_lock(&pool->lock);
+  while(!pool->stop)
+  {
+    if(pool->next < pool->count) { work_through(pool); }
+    else { pthread_cond_wait(&pool->work, &pool->lock); }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+
+struct otp_pool *
+otp_pool_create(int threads)
+{
+  if(threads <= 0)
+  {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    threads = cores > 0 ? cores : 1;
+  }
+
+  struct otp_pool *pool = calloc(1, sizeof(*pool));
+  if(pool == NULL) { return NULL; }
+  pool->tids = calloc(threads, sizeof(*pool->tids));
+  if(pool->tids == NULL)
+  {
+    free(pool);
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  /* The caller is the first thread, so only the rest are started */
+  pool->threads = 1;
+  for(int i = 1; i < threads; i++)
+  {
+    if(pthread_create(&pool->tids[i], NULL, pool_thread, pool) != 0) { break; }
+    pool->threads++;
+  }
+  return pool;
+}
+
+
+int
+otp_pool_threads(struct otp_pool const *pool)
+{
+  return pool->threads;
+}
+
+
+void
+otp_pool_run(struct otp_pool *pool, void (*fn)(void *arg, size_t index), void *arg, size_t count)
+{
+  /* Waking threads costs more than it saves when there is nobody to share with */
+  if(pool->threads == 1 || count <= 1)
+  {
+    for(size_t i = 0; i < count; i++) { fn(arg, i); }
+    return;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  pool->fn = fn;
+  pool->arg = arg;
+  pool->count = count;
+  pool->next = 0;
+  pool->finished = 0;
+  pthread_cond_broadcast(&pool->work);
+  work_through(pool);
+  while(pool->finished < pool->count) { pthread_cond_wait(&pool->done, &pool->lock); }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+
+void
+otp_pool_destroy(struct otp_pool *pool)
+{
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for(int i = 1; i < pool->threads; i++) { pthread_join(pool->tids[i], NULL); }
+
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->done);
+  free(pool->tids);
+  free(pool);
+}
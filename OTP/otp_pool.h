@@ -0,0 +1,30 @@
+#ifndef OTP_POOL_H__
+#define OTP_POOL_H__
+
+/* This header provides a small fork-join thread pool.
+ *
+ * The threads are started once and sleep until handed a run of work
+ * items. The thread asking for the run works through items alongside
+ * them and returns once every item is done, so nothing is left running
+ * in the background and the items may point at memory the caller is
+ * about to reuse.
+ */
+
+#include <stddef.h>
+
+struct otp_pool;
+
+/* Start a pool of threads threads, counting the one that will call otp_pool_run(),
+ * or one per online core when threads is 0. Returns NULL on failure */
+extern struct otp_pool *otp_pool_create(int threads);
+
+/* Threads a run is spread over, counting the caller */
+extern int otp_pool_threads(struct otp_pool const *pool);
+
+/* Call fn(arg, i) for every i below count spread over the pool, returning once all of them have returned */
+extern void otp_pool_run(struct otp_pool *pool, void (*fn)(void *arg, size_t index), void *arg, size_t count);
+
+/* Stop the threads and free the pool */
+extern void otp_pool_destroy(struct otp_pool *pool);
+
+#endif  //OTP_POOL_H__
@@ -0,0 +1,104 @@
+#include <errno.h>
+#include <string.h>
+#include <arpa/inet.h>  // htonl(), ntohl()
+#include <sys/types.h>
+#include <sys/socket.h> // send(), recv()
+
+#include "otp_proto.h"
+
+/**
+ * This function will loop multiple times if the data it needs
+ * to send across the socket has not been sent in full and will
+ * return -1 if it fails and 0 on success
+ */
+int otp_sendall(int sockDesc, void const *buf, size_t len, int flags)
+{
+  size_t total = 0;
+  ssize_t n;
+
+  while(total < len)
+  {
+    n = send(sockDesc, (char const *)buf + total, len - total, flags);
+    if(n == -1)
+    {
+      if(errno == EINTR) { continue; }
+      return -1;
+    }
+    total += n;
+  }
+  return 0;
+}
+
+/**
+ * This function will act as a recv loop to receive all the
+ * data coming across a socket connection and will return -1 if
+ * it fails or the peer closes early, 0 if successful
+ */
+int otp_recvall(int sockDesc, void *buf, size_t len)
+{
+  size_t total = 0;
+  ssize_t n;
+
+  while(total < len)
+  {
+    n = recv(sockDesc, (char *)buf + total, len - total, 0);
+    if(n == -1)
+    {
+      if(errno == EINTR) { continue; }
+      return -1;
+    }
+    /* The peer hung up before sending everything we were promised */
+    if(n == 0)
+    {
+      errno = ECONNRESET;
+      return -1;
+    }
+    total += n;
+  }
+  return 0;
+}
+
+/**
+ * Send the header and both payload blocks. MSG_MORE keeps the kernel
+ * from pushing the header out in its own tiny segment
+ */
+int otp_send_frame(int sockDesc, int type, uint32_t id, void const *first, void const *second, uint32_t len)
+{
+  struct otp_header hdr;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = OTP_MAGIC;
+  hdr.type = type;
+  hdr.id = htonl(id);
+  hdr.length = htonl(len);
+
+  if(otp_sendall(sockDesc, &hdr, sizeof(hdr), len ? MSG_MORE : 0) < 0) { return -1; }
+  if(len == 0) { return 0; }
+  if(otp_sendall(sockDesc, first, len, second ? MSG_MORE : 0) < 0) { return -1; }
+  if(second && otp_sendall(sockDesc, second, len, 0) < 0) { return -1; }
+  return 0;
+}
+
+/**
+ * Read in a frame header, skipping the magic byte if the caller has
+ * already pulled it off the socket to tell frames and legacy messages apart
+ */
+int otp_recv_header(int sockDesc, struct otp_header *hdr, int haveMagic)
+{
+  memset(hdr, 0, sizeof(*hdr));
+  if(haveMagic)
+  {
+    hdr->magic = OTP_MAGIC;
+    if(otp_recvall(sockDesc, (char *)hdr + 1, sizeof(*hdr) - 1) < 0) { return -1; }
+  }
+  else if(otp_recvall(sockDesc, hdr, sizeof(*hdr)) < 0) { return -1; }
+
+  if(hdr->magic != OTP_MAGIC)
+  {
+    errno = EPROTO;
+    return -1;
+  }
+  hdr->id = ntohl(hdr->id);
+  hdr->length = ntohl(hdr->length);
+  return 0;
+}
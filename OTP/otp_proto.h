@@ -0,0 +1,88 @@
+#ifndef OTP_PROTO_H__
+#define OTP_PROTO_H__
+
+/* This header describes the bulk wire protocol shared by the OTP
+ * clients and servers.
+ *
+ * A bulk request frame is a fixed size header followed by the text
+ * block and then the key block, each `length` bytes long. The server
+ * answers every request frame with an OTP_RESULT frame carrying
+ * `length` bytes of output. A message may be sent as one frame, or
+ * streamed as a run of frames that all but the last mark OTP_MORE, so a
+ * whole message costs one round trip or a handful instead of one round
+ * trip per character.
+ *
+ * Every request frame carries an id chosen by the client, which the
+ * server echoes in the result. A connection stays open after a message
+ * ends, so a client can keep one connection for many messages and send
+ * the frames of later messages without waiting for the results of
+ * earlier ones, matching each result to its message by id.
+ *
+ * A client on the same machine connected over a Unix domain socket may
+ * instead hand the server a shared memory region once, as a memfd passed
+ * with SCM_RIGHTS in an OTP_ATTACH frame. Its request frames then mark
+ * OTP_SHM and carry only the offset of their text and key blocks in the
+ * region, and the server writes each result over its text block and
+ * answers with a bare header, so the payload never crosses the socket.
+ *
+ * The legacy protocol sends three byte messages whose first byte is
+ * always a letter, a space or '@', so a frame is told apart from it by
+ * its first byte being OTP_MAGIC.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* First byte of every frame, never valid as the first byte of a legacy message */
+#define OTP_MAGIC '#'
+
+/* Frame types sent by the clients. A client may also send an OTP_ERROR
+ * frame between two frames of a message to abandon the message with that id */
+#define OTP_ENCRYPT 'e'
+#define OTP_DECRYPT 'd'
+#define OTP_ATTACH  's'   /* Sent with a memfd of `length` bytes, sealed against shrinking */
+
+/* Frame types sent by the servers */
+#define OTP_RESULT 'c'
+#define OTP_WRONG  'w'
+#define OTP_ERROR  'x'
+
+/* Frame flags, echoed back by the server in the result frame */
+#define OTP_MORE 0x01   /* More frames of the same message follow */
+#define OTP_SHM  0x02   /* The payload is the 8 byte offset, in network byte order, of the text
+                         * block in the attached region, with the key block right after it */
+
+/* Largest payload a server will accept in a single frame, 64 MiB. A server holds a
+ * whole frame before answering it, so this also bounds the input kept per connection.
+ * A longer message is sent as several frames */
+#define OTP_MAX_PAYLOAD (1u << 26)
+
+/* Status of a server OTP_ERROR answering a frame over OTP_MAX_PAYLOAD, whose payload
+ * the server drops unread before carrying on with the frames after it */
+#define OTP_TOO_LARGE 0x01
+
+struct
+otp_header {
+  unsigned char magic;    /* Always OTP_MAGIC */
+  unsigned char type;     /* One of the frame types above */
+  unsigned char flags;    /* OTP_MORE, OTP_SHM or zero */
+  unsigned char status;   /* Mode of an abandoned message in a client OTP_ERROR, OTP_TOO_LARGE or zero in a server's */
+  uint32_t id;            /* Request id picked by the client and echoed in the result, network byte order */
+  uint32_t length;        /* Payload length, or block length under OTP_SHM, network byte order on the wire */
+};
+
+/* Loop on send()/recv() until all len bytes have been transferred, -1 on failure, 0 on success */
+extern int otp_sendall(int sockDesc, void const *buf, size_t len, int flags);
+extern int otp_recvall(int sockDesc, void *buf, size_t len);
+
+/* Send a frame of the given type and id whose payload is the first block followed by
+ * the optional second block, each len bytes long. Returns -1 on failure, 0 on success */
+extern int otp_send_frame(int sockDesc, int type, uint32_t id, void const *first, void const *second, uint32_t len);
+
+/* Receive a frame header and convert it to host byte order. The magic byte is
+ * read as well unless the caller already consumed it. Returns -1 on failure or
+ * if the header is malformed, 0 on success */
+extern int otp_recv_header(int sockDesc, struct otp_header *hdr, int haveMagic);
+
+#endif  //OTP_PROTO_H__
@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "otp_engine.h"
+#include "otp_proto.h"
+
+/**
+* This program serves both the encryption and the decryption clients
+* from a single port and worker pool, taking the mode from each request.
+* It can also be limited to one mode, in which case clients asking for
+* the other are told they reached the wrong server, exactly as
+* enc_server and dec_server do
+*/
+
+/* Error function used for reporting issues */
+void error(const char *msg) {
+  perror(msg);
+  exit(1);
+} 
+
+int main(int argc, char *argv[]){
+  struct otp_engine_options opts = { .modes = OTP_SERVE_BOTH, .workers = 0, .backlog = SOMAXCONN, .maxConnections = 0,
+                                     .idleTimeout = OTP_IDLE_TIMEOUT };
+  int opt, badUsage = 0;
+
+  /* Modes, worker count, backlog, per worker connection limit, Unix socket, metrics reporting, idle timeout and pool threads are optional, the port is not */
+  while((opt = getopt(argc, argv, "m:w:b:c:a:u:i:t:T:")) != -1)
+  {
+    switch(opt)
+    {
+      case 'm':
+        if(strcmp(optarg, "enc") == 0) { opts.modes = OTP_SERVE_ENCRYPT; }
+        else if(strcmp(optarg, "dec") == 0) { opts.modes = OTP_SERVE_DECRYPT; }
+        else if(strcmp(optarg, "both") == 0) { opts.modes = OTP_SERVE_BOTH; }
+        else { badUsage = 1; }
+        break;
+      case 'w': opts.workers = atoi(optarg); break;
+      case 'b': opts.backlog = atoi(optarg); break;
+      case 'c': opts.maxConnections = atoi(optarg); break;
+      case 'a': opts.adminPath = optarg; break;
+      case 'u': opts.unixPath = optarg; break;
+      case 'i': opts.statsInterval = atoi(optarg); break;
+      case 't': opts.idleTimeout = atoi(optarg); break;
+      case 'T': opts.threads = atoi(optarg); break;
+      default: badUsage = 1; break;
+    }
+  }
+
+  /* Check usage & args */
+  if (badUsage || optind != argc - 1) { 
+    fprintf(stderr,"USAGE: %s [-m enc|dec|both] [-w workers] [-b backlog] [-c maxconnections] [-a adminsocket] [-u unixsocket] [-i statsinterval] [-t idletimeout] [-T threads] port\n", argv[0]); 
+    exit(1);
+  } 
+  opts.port = atoi(argv[optind]);
+
+  /* Bind the port in every worker and serve clients until told to stop */
+  if(otp_engine_serve(&opts) < 0) { error("ERROR starting server"); }
+  return 0;
+}
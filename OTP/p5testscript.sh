@@ -256,6 +256,24 @@ else
 	tput sgr0
 fi
 
+${echo}
+${echo} '#-----------------------------------------'
+tput bold; tput setaf 4; ${echo} -n '#10 POINTS:'; tput sgr0; ${echo} ' a pooled connection left idle past the server timeout is reopened - should show 0 errors'
+((tot+=10))
+idleport=$((RANDOM % 60000 + 1025))
+./enc_server -w 1 -t 2 $idleport 2>/dev/null &
+sleep 1
+${echo} '#otp_bench -a -n 2 -i 4 -s 20 $idleport'
+errors=$(timeout 20 ./otp_bench -a -n 2 -i 4 -s 20 $idleport | tail -n 1 | cut -d, -f7)
+echo "$errors errors"
+if [ "$errors" = "0" ]
+then
+	echo "Looks good!"
+	((pts+=10))
+else
+	echo "Looks not good :("
+fi
+
 #Clean up
 ${echo}
 ${echo} '#-----------------------------------------'